@@ -2,13 +2,47 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <deque>
 #include <chrono>
 #include <cstdlib>
-#include <regex>
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <ctime>
 #include <sstream>
 #include <set>
 #include <thread>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+#include <cmath>
+#include <coroutine>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "lvs_plugin.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
@@ -16,6 +50,9 @@ using namespace std::chrono;
 // ---------------- CONFIG ----------------
 // BACKEND NODES
 vector<string> BACKEND_SERVERS = {"10.1.2.2", "10.1.2.3"};
+vector<string> BACKUP_SERVERS = {};  // put in service only while fewer than MIN_HEALTHY_BACKENDS are up
+string SORRY_SERVER = "";            // put in service only while no backend or backup is up
+int MIN_HEALTHY_BACKENDS = 1;
 
 // Virtual IP that LVS listens on
 string LVS_VIRTUAL_IP = "<eth0_ip_address>";
@@ -27,12 +64,141 @@ vector<string> UDP_SERVICES = {"53", "442", "55665"};
 int LOSS_THRESHOLD = 5;      // % above which the gateway will be droppedd
 int WINDOW_SECONDS = 60;     // sliding window size the seconds it will consider to see the % of packet loss
 int PING_TIMEOUT = 1;        // seconds a ping timeout is considered
+bool PACKED_LOSS_WINDOWS = true; // one bit per sample instead of one int per sample
+string PROBE_ENGINE = "native";  // "native" = ICMP sockets on the event loop, "fping" = one streaming
+                                 // fping coprocess for all servers, "ping" = popen per check.
+                                 // native falls back to fping, fping falls back to ping.
+bool SHADOW_POLICY = false;      // evaluate a second policy on the same samples; log where it disagrees, never apply
+int SHADOW_THRESHOLD = 3;        // % as LOSS_THRESHOLD
+int SHADOW_WINDOW_SECONDS = 30;  // "mean": newest part of the live window, at most WINDOW_SECONDS
+string SHADOW_ESTIMATOR = "mean";  // "mean" = window average, "ewma" = exponentially weighted loss
+double SHADOW_EWMA_ALPHA = 0.1;  // weight of the newest sample for "ewma"
+int BASELINE_WINDOW_SECONDS = 3600;  // span of the learned per-backend RTT median/MAD (rtt.score)
+int BASELINE_MIN_SAMPLES = 60;   // replies needed before rtt.score leaves 0
+bool OUTLIER_DETECTION = false;  // eject backends that are outliers within their service's pool
+int OUTLIER_INTERVAL_S = 10;     // how often pools are compared
+int OUTLIER_MIN_HOSTS = 5;       // healthy primaries a pool needs before anyone is compared
+double OUTLIER_STDEV_FACTOR = 1.9;     // success rate below pool mean - factor * stdev is an outlier
+double OUTLIER_MIN_SUCCESS_GAP = 5.0;  // ... and at least this many points below the mean
+double OUTLIER_LATENCY_FACTOR = 3.0;   // RTT above factor * pool median RTT is an outlier, 0 = off
+double OUTLIER_MIN_LATENCY_MS = 1.0;   // ... and at least this many ms above the median
+int OUTLIER_BASE_EJECTION_S = 30;      // ejection time, times the backend's ejection count
+int OUTLIER_MAX_EJECTION_S = 300;
+int OUTLIER_MAX_EJECTION_PERCENT = 10; // of a pool's primaries; one backend may always be ejected
+bool PASSIVE_HEALTH = false;     // read IPVS per-destination counters (ipvsadm -Ln --stats) every interval
+int PASSIVE_INTERVAL_S = 10;
+int PASSIVE_MIN_CONNS = 10;      // new connections in an interval without reply bytes that flag a destination
+int PASSIVE_HOLD_S = 60;         // a flagged destination stays flagged this long after it was last silent
+string FPING_PATH = "fping";     // looked up in PATH
+int FPING_INTERVAL_MS = 1;       // fping -i: gap between packets to different servers
+
+// Extra per-server checks, run as coroutines on the event loop every tick.
+// type: "tcp" (connect), "smtp" (220, EHLO, 250, QUIT), "http" (GET path, expect status),
+//       "script" (runs `path <server-ip> <port>`, exit 0 = healthy)
+//       or a probe type registered by one of CHECK_PLUGINS (path is passed as its argument)
+// A failed check counts as a lost sample in the server's window, unless the
+// service's health expression uses the check's result directly.
+struct CheckConfig {
+    string name;
+    string type;
+    int port;
+    string path = "/";
+    int expect = 200;
+    vector<string> servers = {};    // only probe these servers; empty = all, the rest count as passing
+};
+vector<string> CHECK_PLUGINS = {};  // shared objects implementing lvs_plugin.h, e.g. "/usr/lib/lvs_monitor/acme.so"
+int SCRIPT_HELPERS = 2;             // pre-forked helper processes that spawn "script" checks
+int SCRIPT_CONCURRENCY = 32;        // scripts running at once per helper; the rest queue
+int SCRIPT_RESTART_SECONDS = 5;     // a dead helper is forked again at most this often
+vector<CheckConfig> CHECKS = {};   // e.g. {"smtp", "smtp", 25}, {"http", "http", 80, "/health", 200}
+int CHECK_TIMEOUT_MS = 900;        // per-check deadline, must fit inside the 1s tick
+
+string KEEPALIVED_CONF = "";        // if set, SERVICES and CHECKS are imported from this keepalived.conf
+
+// Virtual services. Leave SERVICES empty for a single service built from
+// LVS_VIRTUAL_IP, TCP_SERVICES, UDP_SERVICES, BACKEND_SERVERS, BACKUP_SERVERS,
+// SORRY_SERVER and MIN_HEALTHY_BACKENDS.
+// health: when a backend counts as up for this service, e.g.
+//   "icmp.loss < 5 && (tcp443.ok || http.status == 200) && rtt.p99 < 50ms"
+// Inputs: icmp.loss (window %, ICMP only), icmp.latest (%), rtt.last / avg /
+// p50 / p90 / p99 / max (ms over the window; numbers take us, ms or s),
+// <check>.ok and <check>.status for every entry in CHECKS.
+// Operators: < <= > >= == != ! && || and parentheses.
+// Empty: the window loss (ICMP and checks combined) is below LOSS_THRESHOLD.
+// backup: healthy backups join while fewer than min_healthy backends are up.
+// sorry_server: joins while no backend and no backup is up; it is probed but
+// its health is not consulted.
+// probe_source / probe_interface: probes to this service's servers are sent
+// from that IPv4 address / out of that interface (native engine only).
+// probe_mtu: path MTU to the backends; when set, a DF echo filling a packet
+// of that size is sent next to the small one each tick (mtu.* inputs).
+struct ServiceConfig {
+    string name;
+    string vip;
+    vector<string> tcp_ports;
+    vector<string> udp_ports;
+    vector<string> backends;
+    string health = "";
+    vector<string> backup = {};
+    string sorry_server = "";
+    int min_healthy = 1;
+    string netns = "";              // network namespace (`ip netns` name) of the VIP and its backends
+    string probe_source = "";
+    string probe_interface = "";
+    int probe_mtu = 0;
+};
+vector<ServiceConfig> SERVICES = {};
+
+string STATE_DIR = "/var/lib/lvs_monitor";  // transition journal and health history
+bool TRANSITION_JOURNAL = true;              // record every add/remove in STATE_DIR/journal.dat
+bool HEALTH_HISTORY = true;                  // per-backend loss/RTT archives in STATE_DIR/rra
+bool APPLY_METRICS = true;                   // ipvsadm apply counters in STATE_DIR/metrics.prom
+bool PROBE_METRICS = true;                   // per-backend loss, RTT and jitter in STATE_DIR/probe.prom
+int PROBE_METRICS_INTERVAL_S = 10;           // how often probe.prom is rewritten
+
+int APPLY_RETRY_MS = 1000;       // first retry of a failed ipvsadm operation, doubled per failure
+int APPLY_RETRY_MAX_MS = 60000;  // backoff cap
+int APPLY_MAX_OPS_PER_SEC = 200; // ipvsadm calls per second, 0 = unlimited
+int APPLY_MAX_REMOVALS = 0;      // backends removed, across all services, per APPLY_REMOVAL_INTERVAL_S, 0 = unlimited
+int APPLY_REMOVAL_INTERVAL_S = 10;
+bool DRY_RUN = false;            // also --dry-run: plan ipvsadm operations against the live table, apply nothing
+
+#ifdef LVS_ALLOC_ACCOUNTING
+int ACCOUNTING_WARMUP_TICKS = 2;  // ticks allowed to allocate while buffers settle
+int ACCOUNTING_TICKS = 10;        // exit with [PASS] after this many ticks
+#endif
 
 // ---------------- GLOBALS ----------------
-map<string, deque<int>> loss_history;
-map<string, string> server_status;
+// Per-server state lives in flat arrays indexed like `servers` (see SERVICES)
+enum ServerState : uint8_t { STATE_UNKNOWN = 0, STATE_UP = 1, STATE_DOWN = 2 };
+
+const char* state_name(uint8_t s) {
+    return s == STATE_UP ? "UP" : s == STATE_DOWN ? "DOWN" : "UNKNOWN";
+}
+
+vector<uint8_t> server_state;
 set<string> created_services;
 
+// ---------------------------------------------------------
+// ALLOCATION ACCOUNTING (test build: -DLVS_ALLOC_ACCOUNTING)
+// Counts every operator new so main() can fail when a steady-state tick
+// (one without state changes) touches the heap.
+#ifdef LVS_ALLOC_ACCOUNTING
+uint64_t alloc_count = 0;
+
+void* operator new(size_t size) {
+    alloc_count++;
+    void* p = malloc(size ? size : 1);
+    if (!p) abort();
+    return p;
+}
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+#endif
+
 // ---------------------------------------------------------
 // EXPAND PORT RANGES: "11000-12000" → [11000,11001...12000]
 vector<int> expand_ports(const vector<string>& ports_raw) {
@@ -58,141 +224,4770 @@ vector<int> expand_ports(const vector<string>& ports_raw) {
 }
 
 // ---------------------------------------------------------
-int ping_server(const std::string &ip) {
-    std::string cmd =
-        "timeout " + to_string(PING_TIMEOUT) +
-        " ping -c 1 -W 1 " + ip + " 2>&1";
+// Built once per server at startup so the probe loop never formats strings
+string ping_command(const string& ip) {
+    return "timeout " + to_string(PING_TIMEOUT) + " ping -c 1 -W 1 " + ip + " 2>&1";
+}
+
+// Finds "<number>% packet loss" in ping output without std::regex
+int parse_packet_loss(const char* output) {
+    const char* mark = strstr(output, "% packet loss");
+    if (!mark) return 100;
+
+    const char* start = mark;
+    while (start > output && (isdigit((unsigned char)start[-1]) || start[-1] == '.')) start--;
+    if (start == mark) return 100;
+
+    return static_cast<int>(strtof(start, nullptr));
+}
 
-    FILE *pipe = popen(cmd.c_str(), "r");
+int ping_server(const char* cmd) {
+    FILE *pipe = popen(cmd, "r");
     if (!pipe) return 100;
 
-    char buffer[256];
-    std::string output;
-    while (fgets(buffer, sizeof(buffer), pipe))
-        output += buffer;
+    char output[1024];
+    size_t len = 0;
+    while (len < sizeof(output) - 1 && fgets(output + len, sizeof(output) - len, pipe))
+        len += strlen(output + len);
+    output[len] = '\0';
+
+    // Drain anything that did not fit so ping is never blocked on the pipe
+    char discard[256];
+    while (fgets(discard, sizeof(discard), pipe)) {}
 
     pclose(pipe);
 
-    std::regex loss_regex(R"((\d+(\.\d+)?)%\s*packet loss)");
-    std::smatch match;
+    return parse_packet_loss(output); // 100 (DOWN) if parsing fails
+}
+
+// ---------------------------------------------------------
+// FIXED POOL: capacity is allocated once; acquire/release only move indices
+// on a free list whose storage never grows past its initial reservation.
+template <typename T>
+struct FixedPool {
+    vector<T> items;
+    vector<uint32_t> free_slots;
 
-    if (std::regex_search(output, match, loss_regex)) {
-        float loss = 100.0f;
-        std::stringstream ss(match[1].str());
-        ss >> loss;
-        return static_cast<int>(loss);
+    void init(size_t capacity) {
+        vector<T>(capacity).swap(items);
+        free_slots.clear();
+        free_slots.reserve(capacity);
+        for (size_t i = capacity; i > 0; i--) free_slots.push_back(uint32_t(i - 1));
     }
 
-    return 100; // treat as DOWN if parsing fails
-}
+    T* acquire() {
+        if (free_slots.empty()) return nullptr;
+        T* p = &items[free_slots.back()];
+        free_slots.pop_back();
+        return p;
+    }
+
+    void release(T* p) { free_slots.push_back(uint32_t(p - items.data())); }
+    uint32_t index_of(const T* p) const { return uint32_t(p - items.data()); }
+};
+
+// ---------------------------------------------------------
+// NETWORK NAMESPACES
+// A service may live in a named namespace (/run/netns/<name>, as created by
+// `ip netns add`). Each namespace is opened once and its fd kept. Sockets
+// for it are created after switching the monitor's only thread in with
+// setns(); they stay in that namespace when the thread switches back.
+// Processes spawned while switched in (ipvsadm) start there too, so no
+// `ip netns exec` is needed. Index 0 is the namespace the monitor started in.
+struct Netns {
+    vector<string> names{""};
+    vector<int> fds{-1};
+    uint32_t current = 0;
+
+    bool init() {
+        fds[0] = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+        return fds[0] >= 0;
+    }
+
+    // Index of namespace `name`, opened on first use; -1 if it cannot be opened
+    int index(const string& name) {
+        for (size_t k = 0; k < names.size(); k++)
+            if (names[k] == name) return int(k);
+        int fd = open(("/run/netns/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        names.push_back(name);
+        fds.push_back(fd);
+        return int(names.size() - 1);
+    }
+
+    bool enter(uint32_t ns) {
+        if (ns == current) return true;
+        if (setns(fds[ns], CLONE_NEWNET) != 0) {
+            cout << "[ERROR] Cannot enter network namespace " << (ns ? names[ns] : "(initial)") << ": "
+                 << strerror(errno) << endl;
+            return false;
+        }
+        current = ns;
+        return true;
+    }
+
+    size_t size() const { return names.size(); }
+};
+
+Netns netns;
+
+// Switches to a namespace for the lifetime of the guard
+struct NetnsScope {
+    uint32_t saved;
+    bool ok;
+    explicit NetnsScope(uint32_t ns) : saved(netns.current), ok(netns.enter(ns)) {}
+    ~NetnsScope() { netns.enter(saved); }
+};
 
 // ---------------------------------------------------------
-int average_loss(const deque<int>& h) {
-    if (h.empty()) return 0;
-    int sum = 0;
-    for (int x : h) sum += x;
-    return sum / h.size();
+// PROBE PATHS
+// The namespace, egress interface and source address probes to a server are
+// sent with. On a multi-homed director the kernel's route to a backend need
+// not be the interface traffic is forwarded on, so a service can pin its
+// probes. Each path has its own ICMP socket; a server is probed on one path.
+struct ProbePath {
+    uint32_t netns = 0;
+    string interface;                   // SO_BINDTODEVICE when set
+    string source;                      // bind() address when set
+    in_addr source_addr{};
+};
+
+vector<ProbePath> probe_paths(1);       // 0: initial namespace, kernel routing
+
+// Index of the path, added on first use; -1 if source is not an IPv4 address
+int probe_path_index(uint32_t ns, const string& interface, const string& source) {
+    for (size_t k = 0; k < probe_paths.size(); k++) {
+        const ProbePath& p = probe_paths[k];
+        if (p.netns == ns && p.interface == interface && p.source == source) return int(k);
+    }
+    ProbePath p{ns, interface, source};
+    if (!source.empty() && inet_pton(AF_INET, source.c_str(), &p.source_addr) != 1) return -1;
+    probe_paths.push_back(p);
+    return int(probe_paths.size() - 1);
+}
+
+// Binds a fresh socket to its path's interface and source address; the
+// caller has already switched into the path's namespace
+bool bind_probe_path(int fd, uint32_t path) {
+    const ProbePath& p = probe_paths[path];
+    if (!p.interface.empty() &&
+        setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, p.interface.c_str(), socklen_t(p.interface.size())) != 0)
+        return false;
+    if (p.source.empty()) return true;
+    sockaddr_in local{};
+    local.sin_family = AF_INET;
+    local.sin_addr = p.source_addr;
+    return bind(fd, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) == 0;
+}
+
+// e.g. "blue/eth1/10.0.0.5", empty for path 0
+string probe_path_name(uint32_t path) {
+    const ProbePath& p = probe_paths[path];
+    string name = p.netns ? netns.names[p.netns] : "";
+    for (const string* part : {&p.interface, &p.source})
+        if (!part->empty()) name += (name.empty() ? "" : "/") + *part;
+    return name;
 }
 
 // ---------------------------------------------------------
-void create_service_if_needed(char type, int port) {
-    string proto = (type == 't') ? "TCP" : "UDP";
-    string key = proto + ":" + to_string(port);
+// EVENT LOOP (epoll + deadline timers)
+struct EventHandler {
+    uint64_t timer_id = 0;         // armed timer; stale heap entries are skipped
+    virtual void on_event(uint32_t events) = 0;
+    virtual void on_timer() {}
+    virtual ~EventHandler() {}
+};
 
-    if (created_services.count(key)) return;
+struct TimerEntry {
+    steady_clock::time_point when;
+    EventHandler* handler;
+    uint64_t id;
+    bool operator>(const TimerEntry& o) const { return when > o.when; }
+};
 
-    string check_cmd =
-        "ipvsadm -Ln | grep -q \"^" + proto + " " + LVS_VIRTUAL_IP + ":" + to_string(port) + "\"";
+struct EventLoop {
+    int epfd = -1;
+    int pending = 0;               // probes in flight; run_until() returns once it hits 0
+    uint64_t next_timer_id = 0;
+    vector<TimerEntry> timers;     // min-heap on `when`; capacity is reused between ticks
+    epoll_event events[64];
 
-    if (system(check_cmd.c_str()) != 0) {
-        string cmd_add =
-            "ipvsadm -A -" + string(1, type) + " " +
-            LVS_VIRTUAL_IP + ":" + to_string(port) + " -s rr";
+    bool init() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        return epfd >= 0;
+    }
+
+    bool add(int fd, uint32_t ev, EventHandler* h) {
+        epoll_event e{};
+        e.events = ev;
+        e.data.ptr = h;
+        return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) == 0;
+    }
+
+    bool mod(int fd, uint32_t ev, EventHandler* h) {
+        epoll_event e{};
+        e.events = ev;
+        e.data.ptr = h;
+        return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e) == 0;
+    }
+
+    void del(int fd) { epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr); }
+
+    void add_timer(steady_clock::time_point when, EventHandler* h) {
+        h->timer_id = ++next_timer_id;
+        timers.push_back(TimerEntry{when, h, h->timer_id});
+        push_heap(timers.begin(), timers.end(), greater<TimerEntry>());
+    }
+
+    void cancel_timer(EventHandler* h) { h->timer_id = 0; }
+
+    void fire_timers(steady_clock::time_point now) {
+        while (!timers.empty() && timers.front().when <= now) {
+            TimerEntry t = timers.front();
+            pop_heap(timers.begin(), timers.end(), greater<TimerEntry>());
+            timers.pop_back();
+            if (t.handler->timer_id != t.id) continue;
+            t.handler->timer_id = 0;
+            t.handler->on_timer();
+        }
+    }
 
-        (void)system(cmd_add.c_str());
-        cout << "[INFO] Created " << proto << " " << LVS_VIRTUAL_IP << ":" << port << endl;
-        created_services.insert(key);
+    void run_until(steady_clock::time_point deadline) {
+        while (pending > 0) {
+            auto now = steady_clock::now();
+            fire_timers(now);
+            if (pending == 0 || now >= deadline) return;
+
+            auto wake = deadline;
+            if (!timers.empty() && timers.front().when < wake) wake = timers.front().when;
+            auto left = ceil<milliseconds>(wake - now).count();
+
+            int n = epoll_wait(epfd, events, 64, int(left));
+            if (n < 0 && errno != EINTR) return;
+            for (int i = 0; i < n; i++)
+                static_cast<EventHandler*>(events[i].data.ptr)->on_event(events[i].events);
+        }
+    }
+};
+
+// ---------------------------------------------------------
+// NATIVE ICMP ENGINE
+// One ICMP socket per probe path for all of its servers: each tick sends one
+// echo per server and drains the replies from the event loop, so probes run
+// in parallel without spawning processes. Probe contexts come from a
+// FixedPool and the packet buffers are members, so a steady-state tick
+// allocates nothing.
+//
+// Servers with an MTU get a second echo per tick that fills a packet of that
+// size, sent with DF (IP_PMTUDISC_PROBE), so a path that drops full-size
+// packets shows up as MTU loss while the small echo still gets through.
+struct EchoToken {               // echo payload, returned unchanged by the server
+    uint32_t magic;
+    uint32_t slot;               // probe context index in the pool
+    uint64_t generation;         // rejects late replies to a recycled context
+};
+
+const uint32_t ECHO_MAGIC = 0x4c56534du;   // "LVSM"
+
+struct ProbeContext {
+    uint32_t server = 0;
+    uint64_t generation = 0;
+    steady_clock::time_point sent;
+};
+
+uint16_t icmp_checksum(const void* data, size_t len) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint32_t sum = 0;
+    for (; len > 1; p += 2, len -= 2) sum += uint32_t(p[0]) << 8 | p[1];
+    if (len) sum += uint32_t(p[0]) << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(uint16_t(~sum));
+}
+
+struct IcmpEngine;
+
+// One ICMP socket per probe path in use
+struct IcmpSocket : EventHandler {
+    IcmpEngine* engine = nullptr;
+    int fd = -1;
+    bool raw = false;                  // SOCK_RAW needs CAP_NET_RAW, SOCK_DGRAM uses ping_group_range
+    void on_event(uint32_t) override;
+};
+
+struct IcmpEngine {
+    EventLoop* loop = nullptr;
+    vector<IcmpSocket> sockets;        // per probe path
+    bool raw = true;                   // every socket is raw
+    uint16_t ident = 0;
+    uint16_t seq = 0;
+    uint64_t generation = 0;
+
+    vector<sockaddr_in> addrs;
+    vector<uint8_t> addr_ok;
+    vector<uint32_t> socket_of;        // per server
+    FixedPool<ProbeContext> pool;
+    vector<ProbeContext*> inflight;    // per server, null once answered
+    vector<int> loss, rtt_us;          // results of the last tick (rtt_us = -1 when lost)
+    vector<int> mtu;                   // per server, 0 = no large echo
+    vector<ProbeContext*> inflight_mtu;
+    vector<int> mtu_loss;              // 100 when the large echo was lost, 0 otherwise
+
+    unsigned char tx[sizeof(icmphdr) + 56];   // same payload size as ping(8)
+    vector<unsigned char> tx_mtu;      // largest large echo, zero payload
+    vector<unsigned char> rx;
+
+    // server_path: probe path index per server; server_mtu: MTU per server, 0 = none
+    bool init(EventLoop& l, const vector<string>& servers, const vector<uint32_t>& server_path,
+              const vector<int>& server_mtu) {
+        loop = &l;
+        int max_mtu = 0;
+        for (int m : server_mtu) max_mtu = max(max_mtu, m);
+        vector<IcmpSocket>(probe_paths.size()).swap(sockets);
+        for (uint32_t k = 0; k < sockets.size(); k++) {
+            if (k > 0 && find(server_path.begin(), server_path.end(), k) == server_path.end()) continue;
+            NetnsScope in(probe_paths[k].netns);
+            if (!in.ok) return false;
+            IcmpSocket& sock = sockets[k];
+            sock.engine = this;
+            sock.fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+            sock.raw = sock.fd >= 0;
+            if (sock.fd < 0) sock.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+            if (sock.fd < 0) return false;
+            if (!bind_probe_path(sock.fd, k)) {
+                cout << "[ERROR] Cannot bind ICMP socket to " << probe_path_name(k) << ": " << strerror(errno) << endl;
+                return false;
+            }
+            const int pmtu = IP_PMTUDISC_PROBE;
+            if (max_mtu > 0 && setsockopt(sock.fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) != 0)
+                return false;
+            if (!loop->add(sock.fd, EPOLLIN, &sock)) return false;
+            raw &= sock.raw;
+        }
+
+        ident = uint16_t(getpid());
+        const size_t n = servers.size();
+        addrs.assign(n, sockaddr_in{});
+        addr_ok.assign(n, 0);
+        socket_of.assign(server_path.begin(), server_path.end());
+        for (size_t i = 0; i < n; i++) {
+            addrs[i].sin_family = AF_INET;
+            addr_ok[i] = inet_pton(AF_INET, servers[i].c_str(), &addrs[i].sin_addr) == 1;
+            if (!addr_ok[i]) cout << "[WARN] Not an IPv4 address, always DOWN: " << servers[i] << endl;
+        }
+
+        mtu.assign(server_mtu.begin(), server_mtu.end());
+        size_t large = 0;
+        for (int m : mtu) large += m > 0;
+        pool.init(n + large);
+        inflight.assign(n, nullptr);
+        inflight_mtu.assign(n, nullptr);
+        loss.assign(n, 100);
+        mtu_loss.assign(n, 0);
+        rtt_us.assign(n, -1);
+        memset(tx, 0, sizeof(tx));
+        tx_mtu.assign(max_mtu > 0 ? size_t(max_mtu) - sizeof(iphdr) : 0, 0);
+        rx.assign(max(size_t(2048), size_t(max_mtu)), 0);
+        return true;
+    }
+
+    // Fills the echo header and token into buf and sends size bytes of it
+    bool send_echo(size_t i, ProbeContext* ctx, unsigned char* buf, size_t size) {
+        icmphdr* h = reinterpret_cast<icmphdr*>(buf);
+        h->type = ICMP_ECHO;
+        h->code = 0;
+        h->checksum = 0;
+        h->un.echo.id = htons(ident);
+        h->un.echo.sequence = htons(seq);
+        EchoToken token = {ECHO_MAGIC, pool.index_of(ctx), ctx->generation};
+        memcpy(buf + sizeof(icmphdr), &token, sizeof(token));
+        h->checksum = icmp_checksum(buf, size);
+
+        ctx->sent = steady_clock::now();
+        const int fd = sockets[socket_of[i]].fd;
+        return sendto(fd, buf, size, 0, reinterpret_cast<const sockaddr*>(&addrs[i]), sizeof(addrs[i])) >= 0;
+    }
+
+    void start_tick() {
+        seq++;
+        for (size_t i = 0; i < addrs.size(); i++) {
+            loss[i] = 100;
+            rtt_us[i] = -1;
+            if (!addr_ok[i]) continue;
+
+            ProbeContext* ctx = pool.acquire();
+            if (!ctx) continue;
+            ctx->server = uint32_t(i);
+            ctx->generation = ++generation;
+            if (!send_echo(i, ctx, tx, sizeof(tx))) {
+                pool.release(ctx);
+            } else {
+                inflight[i] = ctx;
+                loop->pending++;
+            }
+        }
+
+        // Large echoes go out after every small one, so they never delay them
+        for (size_t i = 0; i < addrs.size(); i++) {
+            if (!mtu[i]) continue;
+            mtu_loss[i] = 100;
+            if (!addr_ok[i]) continue;
+
+            ProbeContext* ctx = pool.acquire();
+            if (!ctx) continue;
+            ctx->server = uint32_t(i);
+            ctx->generation = ++generation;
+            if (!send_echo(i, ctx, tx_mtu.data(), size_t(mtu[i]) - sizeof(iphdr))) {
+                pool.release(ctx);   // EMSGSIZE: the local interface MTU is already smaller
+            } else {
+                inflight_mtu[i] = ctx;
+                loop->pending++;
+            }
+        }
+    }
+
+    // Unanswered echoes count as lost; their contexts go back to the pool
+    void finish_tick() {
+        for (auto* list : {&inflight, &inflight_mtu}) {
+            for (auto& ctx : *list) {
+                if (!ctx) continue;
+                pool.release(ctx);
+                ctx = nullptr;
+                loop->pending--;
+            }
+        }
+    }
+
+    void drain(IcmpSocket& sock) {
+        while (true) {
+            sockaddr_in from{};
+            socklen_t from_len = sizeof(from);
+            ssize_t len = recvfrom(sock.fd, rx.data(), rx.size(), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+            if (len < 0) return;   // EAGAIN: drained
+
+            const unsigned char* p = rx.data();
+            if (sock.raw) {
+                size_t ihl = size_t(rx[0] & 0x0f) * 4;
+                if (size_t(len) < ihl) continue;
+                p += ihl;
+                len -= ihl;
+            }
+            if (size_t(len) < sizeof(icmphdr) + sizeof(EchoToken)) continue;
+
+            const icmphdr* h = reinterpret_cast<const icmphdr*>(p);
+            if (h->type != ICMP_ECHOREPLY) continue;
+            if (sock.raw && ntohs(h->un.echo.id) != ident) continue;
+
+            EchoToken token;
+            memcpy(&token, p + sizeof(icmphdr), sizeof(token));
+            if (token.magic != ECHO_MAGIC || token.slot >= pool.items.size()) continue;
+
+            ProbeContext* ctx = &pool.items[token.slot];
+            const uint32_t i = ctx->server;
+            const bool large = inflight_mtu[i] == ctx;
+            if (ctx->generation != token.generation || (inflight[i] != ctx && !large)) continue;
+            if (from.sin_addr.s_addr != addrs[i].sin_addr.s_addr) continue;
+            if (&sockets[socket_of[i]] != &sock) continue;
+
+            if (large) {
+                mtu_loss[i] = 0;
+                inflight_mtu[i] = nullptr;
+            } else {
+                loss[i] = 0;
+                rtt_us[i] = int(duration_cast<microseconds>(steady_clock::now() - ctx->sent).count());
+                inflight[i] = nullptr;
+            }
+            pool.release(ctx);
+            loop->pending--;
+        }
+    }
+};
+
+void IcmpSocket::on_event(uint32_t) { engine->drain(*this); }
+
+// ---------------------------------------------------------
+// FPING COPROCESS
+// Without CAP_NET_RAW (and no ping_group_range), one long-lived
+// `fping -l` is started for all servers instead of a ping process per server
+// per second. Its per-packet lines are parsed as they stream in:
+//   10.1.2.2 : [12], 64 bytes, 0.41 ms (0.39 avg, 0% loss)
+//   10.1.2.3 : [12], timed out (NaN avg, 100% loss)
+// and demultiplexed into the same per-server loss/rtt results as IcmpEngine.
+// A server counts as up for a tick if any reply for it arrived in the tick.
+// The coprocess is restarted (at most every 5s) if it exits.
+bool parse_fping_line(const char* line, size_t len, in_addr* addr, int* rtt_us, bool* timed_out) {
+    const char* end = line + len;
+    const char* sep = nullptr;
+    for (const char* c = line; c + 4 <= end; c++) {
+        if (memcmp(c, " : [", 4) == 0) {
+            sep = c;
+            break;
+        }
+    }
+    if (!sep || sep - line >= INET_ADDRSTRLEN) return false;
+
+    char ip[INET_ADDRSTRLEN];
+    memcpy(ip, line, sep - line);
+    ip[sep - line] = '\0';
+    if (inet_pton(AF_INET, ip, addr) != 1) return false;
+
+    const char* c = static_cast<const char*>(memchr(sep, ']', end - sep));
+    if (!c) return false;
+    c++;
+    while (c < end && (*c == ',' || *c == ' ')) c++;
+
+    if (end - c >= 9 && memcmp(c, "timed out", 9) == 0) {
+        *timed_out = true;
+        *rtt_us = -1;
+        return true;
     }
+
+    // "<n> bytes, <rtt> ms"
+    while (c + 7 <= end && memcmp(c, "bytes, ", 7) != 0) c++;
+    if (c + 7 > end) return false;
+    char* num_end = nullptr;
+    double ms = strtod(c + 7, &num_end);
+    if (num_end == c + 7 || num_end > end) return false;
+
+    *timed_out = false;
+    *rtt_us = int(ms * 1000.0);
+    return true;
 }
 
+struct FpingEngine : EventHandler {
+    EventLoop* loop = nullptr;
+    pid_t pid = -1;
+    int out_fd = -1;
+    bool counted = false;              // holds one loop.pending while servers are outstanding
+    size_t waiting = 0;
+    steady_clock::time_point last_start;
+
+    vector<string> args;
+    vector<char*> argv;                // points into args, built once
+    vector<pair<uint32_t, uint32_t>> by_addr;   // sorted (s_addr, server index)
+    vector<uint8_t> replied;
+    vector<int> loss, rtt_us;          // results of the last tick, as IcmpEngine
+
+    char buf[8192];
+    size_t len = 0;
+
+    bool init(EventLoop& l, const vector<string>& servers) {
+        loop = &l;
+        const size_t n = servers.size();
+        replied.assign(n, 0);
+        loss.assign(n, 100);
+        rtt_us.assign(n, -1);
+
+        args = {FPING_PATH, "-l", "-p", "1000", "-t", to_string(PING_TIMEOUT * 1000),
+                "-i", to_string(FPING_INTERVAL_MS)};
+        for (size_t i = 0; i < n; i++) {
+            in_addr a;
+            if (inet_pton(AF_INET, servers[i].c_str(), &a) != 1) continue;
+            by_addr.push_back({a.s_addr, uint32_t(i)});
+            args.push_back(servers[i]);
+        }
+        sort(by_addr.begin(), by_addr.end());
+        for (auto& a : args) argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+
+        return by_addr.empty() || start();
+    }
+
+    bool start() {
+        last_start = steady_clock::now();
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) return false;
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], 2);   // ICMP errors: ignored by the parser
+
+        int rc = posix_spawnp(&pid, args[0].c_str(), &actions, nullptr, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[1]);
+        if (rc != 0) {
+            close(fds[0]);
+            pid = -1;
+            errno = rc;
+            return false;
+        }
+
+        out_fd = fds[0];
+        len = 0;
+        fcntl(out_fd, F_SETFL, O_NONBLOCK);
+        return loop->add(out_fd, EPOLLIN, this);
+    }
+
+    void stop() {
+        if (out_fd >= 0) close(out_fd);
+        out_fd = -1;
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+        pid = -1;
+    }
+
+    void start_tick() {
+        if (out_fd < 0 && !by_addr.empty() && steady_clock::now() - last_start >= seconds(5)) {
+            if (start()) cout << "[INFO] Restarted fping coprocess" << endl;
+        }
+
+        for (size_t i = 0; i < replied.size(); i++) replied[i] = 0;
+        waiting = out_fd >= 0 ? by_addr.size() : 0;
+        counted = waiting > 0;
+        if (counted) loop->pending++;
+    }
+
+    void finish_tick() {
+        if (counted) loop->pending--;
+        counted = false;
+        for (size_t i = 0; i < replied.size(); i++) {
+            loss[i] = replied[i] ? 0 : 100;
+            if (!replied[i]) rtt_us[i] = -1;
+        }
+    }
+
+    void on_line(const char* line, size_t n) {
+        in_addr a;
+        int rtt = -1;
+        bool timed_out = false;
+        if (!parse_fping_line(line, n, &a, &rtt, &timed_out) || timed_out) return;
+
+        auto it = lower_bound(by_addr.begin(), by_addr.end(), make_pair(a.s_addr, uint32_t(0)));
+        for (; it != by_addr.end() && it->first == a.s_addr; ++it) {
+            uint32_t i = it->second;
+            rtt_us[i] = rtt;
+            if (replied[i]) continue;
+            replied[i] = 1;
+            if (counted && --waiting == 0) {
+                loop->pending--;
+                counted = false;
+            }
+        }
+    }
+
+    void on_event(uint32_t) override {
+        while (true) {
+            ssize_t n = read(out_fd, buf + len, sizeof(buf) - len);
+            if (n < 0 && errno == EAGAIN) return;
+            if (n <= 0) {
+                cout << "[ERROR] fping coprocess exited; restarting" << endl;
+                loop->del(out_fd);
+                stop();
+                return;
+            }
+            len += n;
+
+            size_t start = 0;
+            for (size_t i = 0; i < len; i++) {
+                if (buf[i] != '\n') continue;
+                on_line(buf + start, i - start);
+                start = i + 1;
+            }
+            if (start == 0 && len == sizeof(buf)) start = len;   // overlong line: drop it
+            memmove(buf, buf + start, len - start);
+            len -= start;
+        }
+    }
+};
+
 // ---------------------------------------------------------
-void add_server_to_lvs(const string& ip) {
-    vector<int> tcp_ports = expand_ports(TCP_SERVICES);
-    vector<int> udp_ports = expand_ports(UDP_SERVICES);
+// COROUTINE PROBES
+// Multi-step checks are written as straight-line co_await code. Each running
+// check owns a CoProbe (from a FixedPool) that is the epoll/timer handler for
+// its socket; awaiting I/O arms the fd and suspends until it is ready, the
+// probe deadline passes, or the tick cancels it. Coroutine frames are carved
+// from a FramePool, so tens of thousands of suspended probes cost no heap
+// traffic once the pool has warmed up.
+// Await results are stored in a local before being tested: g++ 12 miscompiles
+// `if (co_await Awaiter{...} ...)` and never runs the coroutine body.
+struct FramePool {
+    static const size_t BLOCK = 1024;      // larger frames fall back to operator new
+    static const size_t SLAB_BLOCKS = 256;
+    vector<void*> free_blocks;
+    vector<char*> slabs;
+
+    void* allocate(size_t size) {
+        if (size > BLOCK) return ::operator new(size);
+        if (free_blocks.empty()) grow();
+        void* p = free_blocks.back();
+        free_blocks.pop_back();
+        return p;
+    }
+
+    void release(void* p, size_t size) {
+        if (size > BLOCK) ::operator delete(p);
+        else free_blocks.push_back(p);
+    }
+
+    void grow() {
+        char* slab = static_cast<char*>(::operator new(BLOCK * SLAB_BLOCKS));
+        slabs.push_back(slab);
+        free_blocks.reserve(slabs.size() * SLAB_BLOCKS);
+        for (size_t i = 0; i < SLAB_BLOCKS; i++) free_blocks.push_back(slab + i * BLOCK);
+    }
+};
+
+FramePool frame_pool;
+
+// Lazily started task; awaiting it transfers control straight into it and
+// back to the awaiting coroutine when it finishes.
+template <typename T>
+struct Task {
+    struct promise_type {
+        T value{};
+        coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept {
+                coroutine_handle<> c = h.promise().continuation;
+                return c ? c : noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T v) { value = v; }
+        void unhandled_exception() { terminate(); }
+
+        static void* operator new(size_t size) { return frame_pool.allocate(size); }
+        static void operator delete(void* p, size_t size) { frame_pool.release(p, size); }
+    };
+
+    coroutine_handle<promise_type> h;
+
+    Task() {}
+    explicit Task(coroutine_handle<promise_type> handle) : h(handle) {}
+    Task(Task&& o) noexcept : h(o.h) { o.h = nullptr; }
+    Task& operator=(Task&& o) noexcept {
+        if (h) h.destroy();
+        h = o.h;
+        o.h = nullptr;
+        return *this;
+    }
+    Task(const Task&) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> c) noexcept {
+        h.promise().continuation = c;
+        return h;
+    }
+    T await_resume() { return h.promise().value; }
+};
+
+struct CheckOutcome {
+    bool ok;
+    int status;        // protocol reply code (SMTP code, HTTP status), 0 if none
+};
+
+enum WaitResult { WAIT_READY, WAIT_TIMEOUT, WAIT_CANCELLED };
+enum CheckKind { CHECK_TCP, CHECK_SMTP, CHECK_HTTP, CHECK_SCRIPT, CHECK_PLUGIN };
+
+struct CheckRunner;
+
+struct CoProbe : EventHandler {
+    CheckRunner* runner = nullptr;
+    uint32_t check = 0;
+    uint32_t server = 0;
+    uint32_t slot = 0;                // CheckRunner slot of (check, server)
+    uint32_t path = 0;                // probe path of the server
+    int fd = -1;
+    bool armed = false;               // fd registered with epoll
+    bool stopped = false;             // deadline passed or cancelled: every wait fails fast
+    steady_clock::time_point deadline;
+    WaitResult result = WAIT_READY;
+    coroutine_handle<> waiter;
+    Task<CheckOutcome> task;
+    char buf[512];
+    size_t len = 0;
+    uint32_t ready_events = 0;        // epoll events that ended the last wait
+
+    // Plugin probes (see lvs_plugin.h)
+    void* plugin_state = nullptr;
+    uint32_t plugin_watch = 0;        // events requested through watch_fd
+    bool plugin_done = false;
+    bool plugin_ok = false;
+    int plugin_status = 0;
+
+    // Script probes: request id sent to a helper and the exit code it reported
+    uint64_t script_id = 0;
+    int script_exit = -1;
+
+    void on_event(uint32_t events) override {
+        ready_events = events;
+        wake(WAIT_READY);
+    }
+    void on_timer() override {
+        stopped = true;
+        wake(WAIT_TIMEOUT);
+    }
+    void wake(WaitResult r);
+};
+
+// Suspends until p.fd reports `events`, or, with events == 0, until
+// something else calls p.wake() (e.g. a script helper result).
+struct IoWait {
+    CoProbe& p;
+    uint32_t events;
+
+    bool await_ready() const noexcept { return p.stopped; }
+    void await_suspend(coroutine_handle<> h);
+    WaitResult await_resume() const noexcept { return p.stopped && p.result == WAIT_READY ? WAIT_CANCELLED : p.result; }
+};
+
+Task<bool> co_connect(CoProbe& p, sockaddr_in addr) {
+    p.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (p.fd < 0 || (p.path && !bind_probe_path(p.fd, p.path))) co_return false;
+    if (connect(p.fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0) co_return true;
+    if (errno != EINPROGRESS) co_return false;
+
+    WaitResult r = co_await IoWait{p, EPOLLOUT};
+    if (r != WAIT_READY) co_return false;
+
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+    co_return err == 0;
+}
+
+Task<bool> co_send(CoProbe& p, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(p.fd, data, size, MSG_NOSIGNAL);
+        if (n > 0) {
+            data += n;
+            size -= n;
+        } else if (n < 0 && errno == EAGAIN) {
+            WaitResult r = co_await IoWait{p, EPOLLOUT};
+            if (r != WAIT_READY) co_return false;
+        } else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+// Appends whatever the peer sent next to p.buf (NUL-terminated); false on EOF/error/full
+Task<bool> co_read_more(CoProbe& p) {
+    while (p.len < sizeof(p.buf) - 1) {
+        ssize_t n = recv(p.fd, p.buf + p.len, sizeof(p.buf) - 1 - p.len, 0);
+        if (n > 0) {
+            p.len += n;
+            p.buf[p.len] = '\0';
+            co_return true;
+        }
+        if (n == 0 || errno != EAGAIN) co_return false;
+        WaitResult r = co_await IoWait{p, EPOLLIN};
+        if (r != WAIT_READY) co_return false;
+    }
+    co_return false;
+}
+
+// Code of a complete SMTP reply ("250-..." lines end with a "250 ..." line), 0 if incomplete
+int smtp_reply_code(const char* buf, size_t len) {
+    const char* line = buf;
+    const char* end = buf + len;
+    while (line < end) {
+        const char* nl = static_cast<const char*>(memchr(line, '\n', end - line));
+        if (!nl) return 0;
+        if (nl - line >= 4 && isdigit((unsigned char)line[0]) && line[3] == ' ')
+            return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+        if (nl - line < 4 || line[3] != '-') return -1;
+        line = nl + 1;
+    }
+    return 0;
+}
 
-    for (int port : tcp_ports) {
-        create_service_if_needed('t', port);
-        string cmd =
-            "ipvsadm -a -t " + LVS_VIRTUAL_IP + ":" + to_string(port) +
-            " -r " + ip + ":" + to_string(port) + " -m 2>/dev/null";
-        (void)system(cmd.c_str());
+Task<int> co_smtp_reply(CoProbe& p) {
+    p.len = 0;
+    while (true) {
+        bool more = co_await co_read_more(p);
+        if (!more) co_return -1;
+        int code = smtp_reply_code(p.buf, p.len);
+        if (code != 0) co_return code;
     }
+}
 
-    for (int port : udp_ports) {
-        create_service_if_needed('u', port);
-        string cmd =
-            "ipvsadm -a -u " + LVS_VIRTUAL_IP + ":" + to_string(port) +
-            " -r " + ip + ":" + to_string(port) + " -m 2>/dev/null";
-        (void)system(cmd.c_str());
+Task<int> co_http_status(CoProbe& p) {
+    p.len = 0;
+    while (!memchr(p.buf, '\n', p.len)) {
+        bool more = co_await co_read_more(p);
+        if (!more) co_return -1;
     }
+    // "HTTP/1.1 200 OK"
+    const char* sp = static_cast<const char*>(memchr(p.buf, ' ', p.len));
+    if (strncmp(p.buf, "HTTP/", 5) != 0 || !sp) co_return -1;
+    co_return atoi(sp + 1);
+}
+
+Task<CheckOutcome> tcp_check(CoProbe& p, sockaddr_in addr) {
+    bool ok = co_await co_connect(p, addr);
+    co_return CheckOutcome{ok, 0};
+}
 
-    cout << "[INFO] Added " << ip << " back to LVS" << endl;
+Task<CheckOutcome> smtp_check(CoProbe& p, sockaddr_in addr) {
+    static const char ehlo[] = "EHLO lvs-monitor\r\n";
+    static const char quit[] = "QUIT\r\n";
+
+    bool ok = co_await co_connect(p, addr);
+    if (!ok) co_return CheckOutcome{false, 0};
+
+    int code = co_await co_smtp_reply(p);
+    if (code != 220) co_return CheckOutcome{false, code};
+
+    ok = co_await co_send(p, ehlo, sizeof(ehlo) - 1);
+    if (!ok) co_return CheckOutcome{false, code};
+    code = co_await co_smtp_reply(p);
+    if (code != 250) co_return CheckOutcome{false, code};
+
+    co_await co_send(p, quit, sizeof(quit) - 1);
+    co_return CheckOutcome{true, code};
+}
+
+Task<CheckOutcome> http_check(CoProbe& p, sockaddr_in addr, const CheckConfig& c) {
+    bool ok = co_await co_connect(p, addr);
+    if (!ok) co_return CheckOutcome{false, 0};
+
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+    int n = snprintf(p.buf, sizeof(p.buf), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                     c.path.c_str(), host);
+    if (n <= 0 || size_t(n) >= sizeof(p.buf)) co_return CheckOutcome{false, 0};
+    ok = co_await co_send(p, p.buf, n);
+    if (!ok) co_return CheckOutcome{false, 0};
+
+    int status = co_await co_http_status(p);
+    co_return CheckOutcome{status == c.expect, status > 0 ? status : 0};
 }
 
 // ---------------------------------------------------------
-void remove_server_from_lvs(const string& ip) {
-    vector<int> tcp_ports = expand_ports(TCP_SERVICES);
-    vector<int> udp_ports = expand_ports(UDP_SERVICES);
+// CHECK PLUGINS
+// Probe types registered by dlopen()ed shared objects through the C ABI in
+// lvs_plugin.h. A plugin probe runs inside a CoProbe like the built-in
+// checks: the plugin asks for fd readiness via watch_fd and the coroutine
+// below turns that into co_await on the event loop.
+static_assert(LVS_EV_READ == EPOLLIN && LVS_EV_WRITE == EPOLLOUT && LVS_EV_ERROR == EPOLLERR,
+              "plugin event bits must match epoll");
 
-    for (int port : tcp_ports) {
-        string cmd =
-            "ipvsadm -d -t " + LVS_VIRTUAL_IP + ":" + to_string(port) +
-            " -r " + ip + ":" + to_string(port) + " 2>/dev/null";
-        (void)system(cmd.c_str());
+vector<const lvs_probe_type*> plugin_types;
+
+const lvs_probe_type* find_plugin_type(const string& name) {
+    for (const lvs_probe_type* t : plugin_types)
+        if (name == t->name) return t;
+    return nullptr;
+}
+
+extern "C" {
+
+static int host_register_probe_type(const lvs_probe_type* t) {
+    if (!t || t->abi_version != LVS_PLUGIN_ABI_VERSION || t->struct_size < sizeof(lvs_probe_type) ||
+        !t->name || !t->start || !t->on_ready || !t->cancel)
+        return -1;
+    string name = t->name;
+    if (name == "tcp" || name == "smtp" || name == "http" || name == "script" || find_plugin_type(name)) return -1;
+    plugin_types.push_back(t);
+    return 0;
+}
+
+static int host_watch_fd(lvs_probe* probe, int fd, uint32_t events) {
+    CoProbe* p = reinterpret_cast<CoProbe*>(probe);
+    if (fd < 0 || !(events & (LVS_EV_READ | LVS_EV_WRITE))) return -1;
+    if (p->fd >= 0 && p->fd != fd) {
+        close(p->fd);
+        p->armed = false;
     }
+    p->fd = fd;
+    p->plugin_watch = events & (LVS_EV_READ | LVS_EV_WRITE);
+    return 0;
+}
+
+static void host_complete(lvs_probe* probe, int ok, int status) {
+    CoProbe* p = reinterpret_cast<CoProbe*>(probe);
+    p->plugin_done = true;
+    p->plugin_ok = ok != 0;
+    p->plugin_status = status;
+}
+
+static void host_log(const char* message) {
+    cout << "[PLUGIN] " << (message ? message : "") << endl;
+}
+
+}
+
+const lvs_host_api host_api = {
+    LVS_PLUGIN_ABI_VERSION, sizeof(lvs_host_api),
+    host_register_probe_type, host_watch_fd, host_complete, host_log,
+};
 
-    for (int port : udp_ports) {
-        string cmd =
-            "ipvsadm -d -u " + LVS_VIRTUAL_IP + ":" + to_string(port) +
-            " -r " + ip + ":" + to_string(port) + " 2>/dev/null";
-        (void)system(cmd.c_str());
+bool load_plugins(const vector<string>& paths) {
+    for (const auto& path : paths) {
+        void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) {
+            cout << "[ERROR] Cannot load plugin " << path << ": " << dlerror() << endl;
+            return false;
+        }
+
+        auto init = reinterpret_cast<lvs_plugin_init_fn>(dlsym(handle, LVS_PLUGIN_INIT_SYMBOL));
+        size_t before = plugin_types.size();
+        if (!init || init(&host_api) != 0) {
+            cout << "[ERROR] Plugin " << path << " failed to initialize" << endl;
+            return false;
+        }
+        cout << "[INFO] Loaded plugin " << path << " (" << plugin_types.size() - before << " probe types)" << endl;
     }
+    return true;
+}
+
+Task<CheckOutcome> plugin_check(CoProbe& p, sockaddr_in addr, const lvs_probe_type* t, const CheckConfig& c) {
+    lvs_probe* probe = reinterpret_cast<lvs_probe*>(&p);
+    p.plugin_done = false;
+    p.plugin_watch = 0;
+
+    if (t->start(probe, p.plugin_state, &addr, c.path.c_str()) != 0) co_return CheckOutcome{false, 0};
+
+    while (!p.plugin_done) {
+        uint32_t want = p.plugin_watch;
+        p.plugin_watch = 0;
+        // Neither finished nor waiting on anything: the probe is stuck
+        WaitResult r = WAIT_CANCELLED;
+        if (p.fd >= 0 && want != 0) r = co_await IoWait{p, want};
+        if (r != WAIT_READY) {
+            t->cancel(probe, p.plugin_state);
+            co_return CheckOutcome{false, 0};
+        }
 
-    cout << "[WARN] Removed " << ip << " from LVS" << endl;
+        uint32_t ready = p.ready_events & (EPOLLIN | EPOLLOUT | EPOLLERR);
+        if (p.ready_events & EPOLLHUP) ready |= EPOLLERR;
+        // start() ran inside the backend's namespace; so does every resume,
+        // in case the plugin opens its next socket here
+        NetnsScope in(probe_paths[p.path].netns);
+        if (!in.ok) {
+            t->cancel(probe, p.plugin_state);
+            co_return CheckOutcome{false, 0};
+        }
+        t->on_ready(probe, p.plugin_state, p.fd, ready);
+    }
+    co_return CheckOutcome{p.plugin_ok, p.plugin_status};
 }
 
 // ---------------------------------------------------------
-int main() {
-    cout << "[START] LVS Health Monitor (Single Loop Version)\n";
-    cout << "------------------------------------------------\n";
+// SCRIPT HELPER POOL
+// Legacy shell-script checks never run in the monitor process. SCRIPT_HELPERS
+// long-lived helpers are forked at startup; each reads fixed-size requests
+// from a pipe, runs the script with posix_spawn in its own process group,
+// enforces SCRIPT_CONCURRENCY and the request deadline (SIGKILL to the group
+// on expiry) and writes the result back on a second pipe that the event loop
+// watches. Requests and results are smaller than PIPE_BUF, so pipe writes
+// are atomic. A helper that dies is restarted from a fresh image of the
+// binary (`script-helper` mode, pipes on fds 3 and 4) instead of a fork of
+// the running monitor, which would inherit its sockets, pipes and mappings.
+struct ScriptRequest {
+    uint64_t id;
+    uint32_t timeout_ms;
+    uint16_t port;
+    char ip[INET_ADDRSTRLEN];
+    char path[256];
+};
 
-    // Initialize server states
-    for (const auto& s : BACKEND_SERVERS)
-        server_status[s] = "UNKNOWN";
+struct ScriptResult {
+    uint64_t id;
+    int32_t exit_code;          // 128 + signal if killed, -1 if not run
+    uint8_t timed_out;
+};
 
-    while (true) {
-        auto loop_start = steady_clock::now();
+static_assert(sizeof(ScriptRequest) <= PIPE_BUF && sizeof(ScriptResult) <= PIPE_BUF,
+              "script pipe messages must be written atomically");
+
+void write_script_result(int fd, uint64_t id, int exit_code, bool timed_out) {
+    ScriptResult r{id, exit_code, uint8_t(timed_out)};
+    (void)!write(fd, &r, sizeof(r));
+}
+
+// Runs in the helper process; returns when the monitor exits and the request
+// pipe hits EOF, after killing whatever is still running
+void script_helper_main(int req_fd, int res_fd) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, nullptr);
+    int sig_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
 
-        for (const auto& server : BACKEND_SERVERS) {
-            int loss = ping_server(server);
+    struct Job {
+        ScriptRequest req;
+        steady_clock::time_point deadline;
+        pid_t pid;
+    };
+    vector<Job> queued, running;
+    bool open = true;
 
-            auto &h = loss_history[server];
-            h.push_back(loss);
-            if (h.size() > WINDOW_SECONDS) h.pop_front();
+    while (open || !running.empty()) {
+        auto now = steady_clock::now();
 
-            int avg = average_loss(h);
+        // Kill expired scripts (reaped later) and drop expired queued requests
+        for (auto& j : running) {
+            if (j.req.id != 0 && j.deadline <= now) {
+                kill(-j.pid, SIGKILL);
+                write_script_result(res_fd, j.req.id, -1, true);
+                j.req.id = 0;
+            }
+        }
+        for (size_t i = 0; i < queued.size();) {
+            if (queued[i].deadline <= now) {
+                write_script_result(res_fd, queued[i].req.id, -1, true);
+                queued.erase(queued.begin() + i);
+            } else {
+                i++;
+            }
+        }
 
-            cout << "[CHECK] " << server
-                 << " | Latest=" << loss << "% | Avg(" << WINDOW_SECONDS << "s)=" << avg << "%\n";
+        while (open && !queued.empty() && running.size() < size_t(SCRIPT_CONCURRENCY)) {
+            Job j = queued.front();
+            queued.erase(queued.begin());
 
-            if (avg >= LOSS_THRESHOLD && server_status[server] != "DOWN") {
-                remove_server_from_lvs(server);
-                server_status[server] = "DOWN";
-            } else if (avg < LOSS_THRESHOLD && server_status[server] != "UP") {
-                add_server_to_lvs(server);
-                server_status[server] = "UP";
+            char port[8];
+            snprintf(port, sizeof(port), "%u", unsigned(j.req.port));
+            char* argv[] = {j.req.path, j.req.ip, port, nullptr};
+            if (posix_spawn(&j.pid, j.req.path, &actions, &attr, argv, environ) != 0) {
+                write_script_result(res_fd, j.req.id, -1, false);
+                continue;
             }
+            running.push_back(j);
+        }
+
+        int timeout = 1000;
+        for (const auto& j : running)
+            if (j.req.id != 0) timeout = min<int>(timeout, ceil<milliseconds>(j.deadline - now).count());
+        for (const auto& j : queued)
+            timeout = min<int>(timeout, ceil<milliseconds>(j.deadline - now).count());
+
+        pollfd fds[2] = {{open ? req_fd : -1, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+        if (poll(fds, 2, max(timeout, 0)) < 0 && errno != EINTR) break;
+
+        if (fds[0].revents) {
+            ScriptRequest req;
+            ssize_t n = read(req_fd, &req, sizeof(req));
+            if (n == sizeof(req)) {
+                req.ip[sizeof(req.ip) - 1] = '\0';
+                req.path[sizeof(req.path) - 1] = '\0';
+                queued.push_back(Job{req, steady_clock::now() + milliseconds(req.timeout_ms), 0});
+            } else if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+                open = false;     // monitor is gone: stop everything
+                for (auto& j : running) kill(-j.pid, SIGKILL);
+                queued.clear();
+            }
+        }
+
+        if (fds[1].revents) {
+            signalfd_siginfo info;
+            while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {}
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (size_t i = 0; i < running.size(); i++) {
+                if (running[i].pid != pid) continue;
+                if (running[i].req.id != 0) {
+                    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                    write_script_result(res_fd, running[i].req.id, code, false);
+                }
+                running.erase(running.begin() + i);
+                break;
+            }
+        }
+    }
+}
+
+struct ScriptHelper : EventHandler {
+    pid_t pid = -1;
+    int req_fd = -1;
+    int res_fd = -1;
+    bool alive = false;
+    steady_clock::time_point started{};
+    EventLoop* loop = nullptr;
+    CheckRunner* runner = nullptr;
+    ScriptResult results[64];
+
+    void on_event(uint32_t) override;
+};
+
+struct ScriptPool {
+    vector<ScriptHelper> helpers;
+    size_t next = 0;
+    uint64_t next_id = 0;
+
+    // Called first thing in main(), while the process is still small
+    bool start(int count) {
+        vector<ScriptHelper>(count).swap(helpers);
+        for (size_t k = 0; k < helpers.size(); k++)
+            if (!spawn(k)) return false;
+        // A helper can die between its EOF and our next write; that write must fail, not kill us
+        signal(SIGPIPE, SIG_IGN);
+        cout << "[INFO] Started " << count << " script helpers" << endl;
+        return true;
+    }
+
+    // fork() at startup, a fresh image of the binary afterwards
+    bool spawn(size_t k, bool fresh_image = false) {
+        ScriptHelper& h = helpers[k];
+        h.started = steady_clock::now();
+        int req[2], res[2];
+        if (pipe2(req, O_CLOEXEC) != 0) return false;
+        if (pipe2(res, O_CLOEXEC) != 0) {
+            close(req[0]);
+            close(req[1]);
+            return false;
+        }
+
+        h.pid = fresh_image ? spawn_image(req[0], res[1]) : fork();
+        if (h.pid < 0) {
+            close(req[0]); close(req[1]);
+            close(res[0]); close(res[1]);
+            return false;
+        }
+        if (h.pid == 0) {
+            // Only the monitor may hold the write end, or EOF never reaches the helper
+            for (size_t o = 0; o < helpers.size(); o++) {
+                if (o == k) continue;
+                if (helpers[o].req_fd >= 0) close(helpers[o].req_fd);
+                if (helpers[o].res_fd >= 0) close(helpers[o].res_fd);
+            }
+            close(req[1]);
+            close(res[0]);
+            script_helper_main(req[0], res[1]);
+            _exit(0);
+        }
+
+        close(req[0]);
+        close(res[1]);
+        h.req_fd = req[1];
+        h.res_fd = res[0];
+        fcntl(h.req_fd, F_SETFL, O_NONBLOCK);
+        fcntl(h.res_fd, F_SETFL, O_NONBLOCK);
+        h.alive = true;
+        return true;
+    }
+
+    // `lvs_monitor script-helper` with req_fd on 3, res_fd on 4 and nothing else open
+    // but stdio; -1 on failure
+    static pid_t spawn_image(int req_fd, int res_fd) {
+        // Out of the way of 3 and 4, so the first dup2 cannot clobber the second source
+        int from[2] = {req_fd, res_fd}, moved[2] = {-1, -1};
+        for (int k = 0; k < 2; k++)
+            if (from[k] < 5 && (from[k] = moved[k] = fcntl(from[k], F_DUPFD_CLOEXEC, 5)) < 0) break;
+
+        pid_t pid = -1;
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, from[0], 3);
+        posix_spawn_file_actions_adddup2(&actions, from[1], 4);
+        posix_spawn_file_actions_addclosefrom_np(&actions, 5);
+        sigset_t none;
+        sigemptyset(&none);
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        posix_spawnattr_setsigmask(&attr, &none);
+        char arg0[] = "lvs_monitor", arg1[] = "script-helper";
+        char* argv[] = {arg0, arg1, nullptr};
+        if (from[0] >= 0 && from[1] >= 0) {
+            if (int err = posix_spawn(&pid, "/proc/self/exe", &actions, &attr, argv, environ)) {
+                errno = err;
+                pid = -1;
+            }
+        }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        for (int fd : moved)
+            if (fd >= 0) close(fd);
+        return pid;
+    }
+
+    bool attach(EventLoop& loop, CheckRunner* runner) {
+        for (auto& h : helpers) {
+            h.loop = &loop;
+            h.runner = runner;
+            if (!loop.add(h.res_fd, EPOLLIN, &h)) return false;
+        }
+        return true;
+    }
+
+    // Once per tick: reap helpers whose pipe hit EOF and fork them again, at
+    // most once per SCRIPT_RESTART_SECONDS each so a helper that dies at
+    // startup does not turn into a fork loop
+    void restart_dead(steady_clock::time_point now) {
+        for (size_t k = 0; k < helpers.size(); k++) {
+            ScriptHelper& h = helpers[k];
+            if (h.alive) continue;
+            if (h.pid > 0) {
+                int status = 0;
+                if (waitpid(h.pid, &status, WNOHANG) != h.pid) continue;   // not gone yet
+                h.pid = -1;
+                if (h.req_fd >= 0) close(h.req_fd);
+                close(h.res_fd);
+                h.req_fd = h.res_fd = -1;
+            }
+            if (now - h.started < seconds(SCRIPT_RESTART_SECONDS)) continue;
+            if (!spawn(k, true)) {
+                cout << "[ERROR] Cannot restart script helper " << k << ": " << strerror(errno) << endl;
+                continue;
+            }
+            if (!h.loop->add(h.res_fd, EPOLLIN, &h)) {
+                close(h.req_fd);   // the helper sees EOF, exits and is reaped next tick
+                h.req_fd = -1;
+                h.alive = false;
+                continue;
+            }
+            cout << "[INFO] Restarted script helper " << k << " as pid " << h.pid << endl;
+        }
+    }
+
+    bool submit(CoProbe& p, const sockaddr_in& addr, const CheckConfig& c, uint32_t slot) {
+        if (helpers.empty()) return false;
+
+        ScriptRequest req{};
+        req.id = (++next_id << 32) | slot;
+        auto left = duration_cast<milliseconds>(p.deadline - steady_clock::now()).count();
+        req.timeout_ms = uint32_t(max<long long>(left, 1));
+        req.port = ntohs(addr.sin_port);
+        inet_ntop(AF_INET, &addr.sin_addr, req.ip, sizeof(req.ip));
+        if (c.path.size() >= sizeof(req.path)) return false;
+        memcpy(req.path, c.path.c_str(), c.path.size() + 1);
+
+        for (size_t tries = 0; tries < helpers.size(); tries++) {
+            ScriptHelper& h = helpers[next++ % helpers.size()];
+            if (!h.alive) continue;
+            if (write(h.req_fd, &req, sizeof(req)) == ssize_t(sizeof(req))) {
+                p.script_id = req.id;
+                p.script_exit = -1;
+                return true;
+            }
+        }
+        return false;   // every helper is dead or its pipe is full
+    }
+
+    void deliver(CheckRunner* runner, const ScriptResult& r);
+};
+
+ScriptPool script_pool;
+
+Task<CheckOutcome> script_check(CoProbe& p, sockaddr_in addr, const CheckConfig& c, uint32_t slot) {
+    if (!script_pool.submit(p, addr, c, slot)) co_return CheckOutcome{false, 0};
+    WaitResult r = co_await IoWait{p, 0};
+    if (r != WAIT_READY) co_return CheckOutcome{false, 0};
+    co_return CheckOutcome{p.script_exit == 0, p.script_exit};
+}
+
+Task<CheckOutcome> run_check(CoProbe& p, CheckKind kind, sockaddr_in addr, const CheckConfig& c,
+                             const lvs_probe_type* plugin, uint32_t slot) {
+    addr.sin_port = htons(uint16_t(c.port));
+    switch (kind) {
+    case CHECK_TCP:    co_return co_await tcp_check(p, addr);
+    case CHECK_SMTP:   co_return co_await smtp_check(p, addr);
+    case CHECK_HTTP:   co_return co_await http_check(p, addr, c);
+    case CHECK_SCRIPT: co_return co_await script_check(p, addr, c, slot);
+    case CHECK_PLUGIN: co_return co_await plugin_check(p, addr, plugin, c);
+    }
+    co_return CheckOutcome{false, 0};
+}
+
+// Starts every (check, server) coroutine at the top of a tick and cancels
+// whatever is still suspended when the tick ends. Only the pairs a check
+// applies to get a slot: check_slots[c]..check_slots[c + 1] are check c's,
+// in server order, and server_slots/server_slot group the same slots by
+// server. A pair without a slot is never run and always passes.
+constexpr uint32_t NO_SLOT = ~0u;
+
+struct CheckRunner {
+    EventLoop* loop = nullptr;
+    const vector<CheckConfig>* checks = nullptr;
+    vector<CheckKind> kinds;
+    vector<const lvs_probe_type*> plugin_of;   // per check, null for built-ins
+    vector<size_t> state_base, state_stride;    // plugin state in plugin_arena, in max_align_t units
+    vector<max_align_t> plugin_arena;
+    size_t servers = 0;
+    vector<sockaddr_in> addrs;
+    vector<uint8_t> addr_ok;
+    vector<uint32_t> check_slots;     // CSR offsets, one per check plus one
+    vector<uint32_t> slot_server;
+    vector<uint32_t> server_slots;    // CSR offsets, one per server plus one
+    vector<uint32_t> server_slot;
+    FixedPool<CoProbe> pool;
+    vector<CoProbe*> inflight;        // per slot
+    vector<uint8_t> ok;               // results of the last tick, per slot
+    vector<int> status;
+    const vector<uint32_t>* server_path = nullptr;
+
+    bool init(EventLoop& l, const vector<string>& server_ips, const vector<uint32_t>& path_of,
+              const vector<CheckConfig>& cfg) {
+        loop = &l;
+        checks = &cfg;
+        server_path = &path_of;
+        servers = server_ips.size();
+        size_t arena_units = 0;
+        for (const auto& c : cfg) {
+            const lvs_probe_type* plugin = nullptr;
+            if (c.type == "tcp") kinds.push_back(CHECK_TCP);
+            else if (c.type == "smtp") kinds.push_back(CHECK_SMTP);
+            else if (c.type == "http") kinds.push_back(CHECK_HTTP);
+            else if (c.type == "script") kinds.push_back(CHECK_SCRIPT);
+            else if ((plugin = find_plugin_type(c.type))) kinds.push_back(CHECK_PLUGIN);
+            else {
+                cout << "[ERROR] Unknown check type '" << c.type << "' for check " << c.name << endl;
+                return false;
+            }
+            plugin_of.push_back(plugin);
+
+            // The servers this check applies to
+            check_slots.push_back(uint32_t(slot_server.size()));
+            for (size_t i = 0; i < servers; i++)
+                if (c.servers.empty() || find(c.servers.begin(), c.servers.end(), server_ips[i]) != c.servers.end())
+                    slot_server.push_back(uint32_t(i));
+
+            size_t stride = plugin ? (plugin->state_size + sizeof(max_align_t) - 1) / sizeof(max_align_t) : 0;
+            state_base.push_back(arena_units);
+            state_stride.push_back(stride);
+            arena_units += stride * (slot_server.size() - check_slots.back());
+        }
+        check_slots.push_back(uint32_t(slot_server.size()));
+        plugin_arena.assign(arena_units, max_align_t());
+
+        // Script helpers are forked in the initial namespace and would probe the wrong one
+        for (size_t c = 0; c < cfg.size(); c++) {
+            if (kinds[c] != CHECK_SCRIPT) continue;
+            for (uint32_t slot = check_slots[c]; slot < check_slots[c + 1]; slot++) {
+                const uint32_t ns = probe_paths[path_of[slot_server[slot]]].netns;
+                if (ns == 0) continue;
+                cout << "[ERROR] Script check " << cfg[c].name << " cannot probe " << server_ips[slot_server[slot]]
+                     << " in network namespace " << netns.names[ns] << "; limit it with its servers list" << endl;
+                return false;
+            }
+        }
+
+        const size_t total = slot_server.size();
+        server_slots.assign(servers + 1, 0);
+        for (uint32_t i : slot_server) server_slots[i + 1]++;
+        for (size_t i = 0; i < servers; i++) server_slots[i + 1] += server_slots[i];
+        server_slot.assign(total, 0);
+        vector<uint32_t> cursor(server_slots.begin(), server_slots.end() - 1);
+        for (uint32_t slot = 0; slot < total; slot++) server_slot[cursor[slot_server[slot]]++] = slot;
+
+        addrs.assign(servers, sockaddr_in{});
+        addr_ok.assign(servers, 0);
+        for (size_t i = 0; i < servers; i++) {
+            addrs[i].sin_family = AF_INET;
+            addr_ok[i] = inet_pton(AF_INET, server_ips[i].c_str(), &addrs[i].sin_addr) == 1;
+        }
+
+        pool.init(total);
+        inflight.assign(total, nullptr);
+        ok.assign(total, 0);
+        status.assign(total, 0);
+
+        // Every running check holds a socket
+        rlimit rl;
+        if (total > 0 && getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < total + 64) {
+            rl.rlim_cur = min<rlim_t>(rl.rlim_max, total + 64);
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        return true;
+    }
+
+    // Checks open their sockets before they first suspend, so each
+    // namespace's probes are started while the thread is switched into it
+    void start_tick(steady_clock::time_point deadline) {
+        for (uint32_t ns = 0; ns < netns.size(); ns++) start_netns(ns, netns.enter(ns), deadline);
+        netns.enter(0);
+    }
+
+    // Without `entered`, the namespace's checks fail for this tick
+    void start_netns(uint32_t ns, bool entered, steady_clock::time_point deadline) {
+        for (size_t c = 0; c < kinds.size(); c++) {
+            for (uint32_t slot = check_slots[c]; slot < check_slots[c + 1]; slot++) {
+                const uint32_t i = slot_server[slot];
+                if (probe_paths[(*server_path)[i]].netns != ns) continue;
+                ok[slot] = 0;
+                status[slot] = 0;
+                if (!entered || !addr_ok[i] || inflight[slot]) continue;
+
+                CoProbe* p = pool.acquire();
+                if (!p) continue;
+                p->runner = this;
+                p->check = uint32_t(c);
+                p->server = i;
+                p->slot = slot;
+                p->path = (*server_path)[i];
+                p->fd = -1;
+                p->armed = false;
+                p->stopped = false;
+                p->deadline = deadline;
+                p->result = WAIT_READY;
+                p->waiter = nullptr;
+                p->len = 0;
+                p->plugin_state = nullptr;
+                if (plugin_of[c]) {
+                    p->plugin_state = &plugin_arena[state_base[c] + (slot - check_slots[c]) * state_stride[c]];
+                    memset(p->plugin_state, 0, state_stride[c] * sizeof(max_align_t));
+                }
+                p->task = run_check(*p, kinds[c], addrs[i], (*checks)[c], plugin_of[c], pool.index_of(p));
+
+                inflight[slot] = p;
+                loop->pending++;
+                loop->add_timer(deadline, p);
+
+                p->task.h.resume();
+                if (p->task.h.done()) complete(p);
+            }
+        }
+    }
+
+    void finish_tick() {
+        for (CoProbe* p : inflight) {
+            if (!p) continue;
+            p->stopped = true;
+            p->wake(WAIT_CANCELLED);
+        }
+    }
+
+    void complete(CoProbe* p) {
+        const uint32_t slot = p->slot;
+        CheckOutcome r = p->task.h.promise().value;
+        ok[slot] = r.ok;
+        status[slot] = r.status;
+
+        p->task = Task<CheckOutcome>();
+        p->script_id = 0;
+        if (p->fd >= 0) close(p->fd);   // also drops it from epoll
+        p->fd = -1;
+        loop->cancel_timer(p);
+
+        inflight[slot] = nullptr;
+        pool.release(p);
+        loop->pending--;
+    }
+
+    bool any_failed(size_t server) const {
+        for (uint32_t k = server_slots[server]; k < server_slots[server + 1]; k++)
+            if (!ok[server_slot[k]]) return true;
+        return false;
+    }
+
+    uint32_t slot_of(size_t check, size_t server) const {
+        auto first = slot_server.begin() + check_slots[check], last = slot_server.begin() + check_slots[check + 1];
+        auto it = lower_bound(first, last, uint32_t(server));
+        return it != last && *it == server ? uint32_t(it - slot_server.begin()) : NO_SLOT;
+    }
+
+    bool passed(size_t check, size_t server) const {
+        uint32_t slot = slot_of(check, server);
+        return slot == NO_SLOT || ok[slot];
+    }
+
+    int status_of(size_t check, size_t server) const {
+        uint32_t slot = slot_of(check, server);
+        return slot == NO_SLOT ? 0 : status[slot];
+    }
+};
+
+void ScriptHelper::on_event(uint32_t) {
+    while (true) {
+        ssize_t n = read(res_fd, results, sizeof(results));
+        if (n > 0) {
+            for (size_t i = 0; i < size_t(n) / sizeof(ScriptResult); i++)
+                script_pool.deliver(runner, results[i]);
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN) {
+            cout << "[ERROR] Script helper " << pid << " exited; restarting it" << endl;
+            loop->del(res_fd);
+            alive = false;
+        }
+        return;
+    }
+}
+
+void ScriptPool::deliver(CheckRunner* runner, const ScriptResult& r) {
+    uint32_t slot = uint32_t(r.id);
+    if (slot >= runner->pool.items.size()) return;
+    CoProbe& p = runner->pool.items[slot];
+    if (p.script_id != r.id) return;     // late result for a probe that already ended
+    p.script_id = 0;
+    p.script_exit = r.timed_out ? -1 : r.exit_code;
+    p.wake(WAIT_READY);
+}
+
+void CoProbe::wake(WaitResult r) {
+    if (!waiter) return;
+    coroutine_handle<> h = waiter;
+    waiter = nullptr;
+    result = r;
+    h.resume();
+    if (task.h && task.h.done()) runner->complete(this);
+}
+
+void IoWait::await_suspend(coroutine_handle<> h) {
+    p.waiter = h;
+    p.result = WAIT_READY;
+    if (events == 0) return;
+    uint32_t ev = events | EPOLLONESHOT;
+    if (p.armed) {
+        p.runner->loop->mod(p.fd, ev, &p);
+    } else {
+        p.runner->loop->add(p.fd, ev, &p);
+        p.armed = true;
+    }
+}
+
+// ---------------------------------------------------------
+// LOSS RING: the one-int-per-sample window used when PACKED_LOSS_WINDOWS is
+// false. Flat and preallocated; the running sum makes each push O(1).
+struct LossRing {
+    size_t servers = 0;
+    size_t window = 0;
+    size_t cursor = 0;
+    vector<int> samples;        // window * servers, sample-major
+    vector<uint32_t> sums;
+
+    void init(size_t n, int window_samples) {
+        servers = n;
+        window = window_samples > 0 ? window_samples : 1;
+        cursor = 0;
+        samples.assign(window * servers, 0);
+        sums.assign(servers, 0);
+    }
+
+    void push_all(const int* loss, uint32_t* loss_sum) {
+        int* row = &samples[cursor * servers];
+        for (size_t i = 0; i < servers; i++) {
+            sums[i] += loss[i] - row[i];
+            row[i] = loss[i];
+            loss_sum[i] = sums[i];
+        }
+        cursor = (cursor + 1) % window;
+    }
+
+    // Loss sum of each server's newest k samples
+    void recent_sums(size_t k, uint32_t* loss_sum) const {
+        for (size_t i = 0; i < servers; i++) loss_sum[i] = 0;
+        for (size_t j = 0; j < min(k, window); j++) {
+            const int* row = &samples[((cursor + window - 1 - j) % window) * servers];
+            for (size_t i = 0; i < servers; i++) loss_sum[i] += row[i];
+        }
+    }
+
+    // Newest 64 samples of server i, bit 0 = newest, 1 = lost
+    uint64_t recent(size_t i) const {
+        uint64_t out = 0;
+        for (size_t k = 0; k < min<size_t>(window, 64); k++)
+            out |= uint64_t(samples[((cursor + window - 1 - k) % window) * servers + i] > 0) << k;
+        return out;
+    }
+};
+
+// ---------------------------------------------------------
+// PACKED LOSS WINDOWS
+// A single-echo sample is either 0% or 100% loss, so each sample is stored as
+// one bit (1 = lost) and the window loss is a popcount. Words are laid out
+// word-major (word w of every server is contiguous) so one tick touches one
+// row of the array, and the update, popcount and threshold test are plain
+// loops over flat arrays that the compiler can vectorize.
+struct PackedLossWindows {
+    size_t servers = 0;
+    size_t window = 0;          // samples per window
+    size_t words = 0;           // uint64 words per server
+    size_t cursor = 0;          // next sample slot, shared by all servers
+    size_t filled = 0;          // samples currently in the window
+    vector<uint64_t> bits;      // words * servers
+    vector<uint64_t> mask;      // scratch: recent_sums() slot mask per word
+
+    void init(size_t n, int window_samples) {
+        servers = n;
+        window = window_samples > 0 ? window_samples : 1;
+        words = (window + 63) / 64;
+        cursor = filled = 0;
+        bits.assign(words * servers, 0);
+        mask.assign(words, 0);
+    }
+
+    // Loss sum (lost * 100) of each server's newest k samples: one mask of
+    // their slots, then the same popcount pass as push_all
+    void recent_sums(size_t k, uint32_t* loss_sum) {
+        for (size_t w = 0; w < words; w++) mask[w] = 0;
+        for (size_t j = 0; j < min(k, window); j++) {
+            size_t s = (cursor + window - 1 - j) % window;
+            mask[s / 64] |= uint64_t(1) << (s % 64);
+        }
+        for (size_t i = 0; i < servers; i++) loss_sum[i] = 0;
+        for (size_t w = 0; w < words; w++) {
+            if (!mask[w]) continue;
+            const uint64_t* r = &bits[w * servers];
+            for (size_t i = 0; i < servers; i++) loss_sum[i] += __builtin_popcountll(r[i] & mask[w]);
+        }
+        for (size_t i = 0; i < servers; i++) loss_sum[i] *= 100;
+    }
+
+    // Record one sample per server (sample_lost[i] != 0 means lost) and
+    // write each server's window loss sum (lost samples * 100).
+    void push_all(const uint8_t* sample_lost, uint32_t* loss_sum) {
+        uint64_t* row = &bits[(cursor / 64) * servers];
+        const unsigned shift = cursor % 64;
+        const uint64_t keep = ~(uint64_t(1) << shift);
+        for (size_t i = 0; i < servers; i++)
+            row[i] = (row[i] & keep) | (uint64_t(sample_lost[i] != 0) << shift);
+
+        cursor = (cursor + 1) % window;
+        if (filled < window) filled++;
+
+        for (size_t i = 0; i < servers; i++) loss_sum[i] = 0;
+        for (size_t w = 0; w < words; w++) {
+            const uint64_t* r = &bits[w * servers];
+            for (size_t i = 0; i < servers; i++)
+                loss_sum[i] += __builtin_popcountll(r[i]);
+        }
+        for (size_t i = 0; i < servers; i++) loss_sum[i] *= 100;
+    }
+
+    // Newest 64 samples of server i, bit 0 = newest, 1 = lost
+    uint64_t recent(size_t i) const {
+        uint64_t out = 0;
+        for (size_t k = 0; k < min<size_t>(filled, 64); k++) {
+            size_t s = (cursor + window - 1 - k) % window;
+            out |= ((bits[(s / 64) * servers + i] >> (s % 64)) & 1) << k;
+        }
+        return out;
+    }
+};
+
+PackedLossWindows packed_windows;
+LossRing loss_ring;
+
+// ---------------------------------------------------------
+// DECISION KERNEL
+// For every server: avg = loss_sum / samples, want = DOWN if avg >= threshold
+// else UP. state[] is updated in place and bit i of changed[] is set when
+// server i flipped, so only the changed set reaches the IPVS apply path.
+// avg >= threshold is tested as loss_sum >= threshold * samples (no division).
+typedef void (*DecideFn)(const uint32_t* loss_sum, size_t n, uint32_t samples, int threshold,
+                         int* avg, uint8_t* state, uint64_t* changed);
+
+void decide_scalar(const uint32_t* loss_sum, size_t n, uint32_t samples, int threshold,
+                   int* avg, uint8_t* state, uint64_t* changed) {
+    const uint32_t limit = uint32_t(threshold) * samples;
+    for (size_t w = 0; w < (n + 63) / 64; w++) changed[w] = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        avg[i] = int(loss_sum[i] / samples);
+        uint8_t want = STATE_UP + (loss_sum[i] >= limit);
+        changed[i / 64] |= uint64_t(state[i] != want) << (i % 64);
+        state[i] = want;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void decide_avx2(const uint32_t* loss_sum, size_t n, uint32_t samples, int threshold,
+                 int* avg, uint8_t* state, uint64_t* changed) {
+    const uint32_t limit = uint32_t(threshold) * samples;
+    for (size_t w = 0; w < (n + 63) / 64; w++) changed[w] = 0;
+
+    // Window sums are small (<= 100 * samples), so signed 32-bit compares are safe
+    const __m256i limit_m1 = _mm256_set1_epi32(int(limit) - 1);
+    const __m256i one = _mm256_set1_epi32(STATE_UP);
+    const __m256d div = _mm256_set1_pd(double(samples));
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i sum = _mm256_loadu_si256((const __m256i*)(loss_sum + i));
+
+        // Exact truncating division: a double quotient never rounds across an integer
+        __m128i avg_lo = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)), div));
+        __m128i avg_hi = _mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)), div));
+        _mm256_storeu_si256((__m256i*)(avg + i), _mm256_set_m128i(avg_hi, avg_lo));
+
+        __m256i over = _mm256_cmpgt_epi32(sum, limit_m1);          // -1 where avg >= threshold
+        __m256i want = _mm256_sub_epi32(one, over);                 // UP (1) or DOWN (2)
+        __m256i cur = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(state + i)));
+        unsigned same = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(cur, want)));
+        changed[i / 64] |= uint64_t(~same & 0xffu) << (i % 64);
+
+        __m128i w16 = _mm_packus_epi32(_mm256_castsi256_si128(want), _mm256_extracti128_si256(want, 1));
+        _mm_storel_epi64((__m128i*)(state + i), _mm_packus_epi16(w16, w16));
+    }
+
+    for (; i < n; i++) {
+        avg[i] = int(loss_sum[i] / samples);
+        uint8_t want = STATE_UP + (loss_sum[i] >= limit);
+        changed[i / 64] |= uint64_t(state[i] != want) << (i % 64);
+        state[i] = want;
+    }
+}
+#endif
+
+DecideFn select_decide_kernel(const char** name) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return decide_avx2;
+    }
+#endif
+    *name = "scalar";
+    return decide_scalar;
+}
+
+// ---------------------------------------------------------
+// RTT WINDOWS: the last WINDOW_SECONDS echo round-trip times per server, in
+// the same sample-major layout as LossRing (-1 = lost). Only kept when a
+// health expression reads rtt.*.
+enum RttStat { RTT_LAST, RTT_AVG, RTT_P50, RTT_P90, RTT_P99, RTT_MAX, RTT_STATS };
+
+struct RttWindows {
+    size_t servers = 0;
+    size_t window = 0;
+    size_t cursor = 0;
+    vector<int32_t> samples;    // window * servers, sample-major
+    vector<int32_t> scratch;    // one server's valid samples, sorted
+
+    void init(size_t n, int window_samples) {
+        servers = n;
+        window = window_samples > 0 ? window_samples : 1;
+        cursor = 0;
+        samples.assign(window * servers, -1);
+        scratch.assign(window, 0);
+    }
+
+    void push_all(const int* rtt_us) {
+        int32_t* row = &samples[cursor * servers];
+        for (size_t i = 0; i < servers; i++) row[i] = rtt_us ? rtt_us[i] : -1;
+        cursor = (cursor + 1) % window;
+    }
+
+    // Window statistics of one server in ms; HUGE_VAL when nothing replied
+    void summarize(size_t i, double* out) {
+        size_t k = 0;
+        int64_t sum = 0;
+        for (size_t s = 0; s < window; s++) {
+            int32_t v = samples[s * servers + i];
+            if (v >= 0) {
+                scratch[k++] = v;
+                sum += v;
+            }
+        }
+        int32_t last = samples[((cursor + window - 1) % window) * servers + i];
+        out[RTT_LAST] = last >= 0 ? last / 1000.0 : HUGE_VAL;
+        if (k == 0) {
+            for (int st = RTT_AVG; st < RTT_STATS; st++) out[st] = HUGE_VAL;
+            return;
+        }
+        sort(scratch.begin(), scratch.begin() + k);
+        auto rank = [&](int pct) { return scratch[(k * pct + 99) / 100 - 1] / 1000.0; };  // nearest rank
+        out[RTT_AVG] = double(sum) / k / 1000.0;
+        out[RTT_P50] = rank(50);
+        out[RTT_P90] = rank(90);
+        out[RTT_P99] = rank(99);
+        out[RTT_MAX] = scratch[k - 1] / 1000.0;
+    }
+};
+
+// ---------------------------------------------------------
+// JITTER: O(1) state per server, updated from every answered echo. Jitter is
+// the RFC 3550 interarrival estimate applied to round-trip times,
+// J += (|D| - J) / 16 starting from J = 0, with D the difference of
+// consecutive RTTs. The RTT mean and variance are exponentially weighted
+// with the same gain. Lost echoes are skipped, so D is taken between
+// consecutive replies.
+struct JitterEstimator {
+    size_t servers = 0;
+    vector<int32_t> last_us;            // previous RTT, -1 before the first reply
+    vector<uint8_t> replies;            // 0, 1 or 2 (= at least two)
+    vector<double> jitter_us, mean_us, var_us2;
+
+    void init(size_t n) {
+        servers = n;
+        last_us.assign(n, -1);
+        replies.assign(n, 0);
+        jitter_us.assign(n, 0);
+        mean_us.assign(n, 0);
+        var_us2.assign(n, 0);
+    }
+
+    // rtt_us may be null (ping engine): nothing is learned
+    void update_all(const int* rtt_us) {
+        if (!rtt_us) return;
+        const double gain = 1.0 / 16;
+        for (size_t i = 0; i < servers; i++) {
+            const int32_t r = rtt_us[i];
+            if (r < 0) continue;
+            if (replies[i] == 0) {
+                mean_us[i] = r;
+                replies[i] = 1;
+            } else {
+                const double d = fabs(double(r) - last_us[i]);
+                jitter_us[i] += (d - jitter_us[i]) * gain;   // from J = 0, as RFC 3550 6.4.1
+                replies[i] = 2;
+                const double diff = r - mean_us[i];
+                mean_us[i] += gain * diff;
+                var_us2[i] = (1 - gain) * (var_us2[i] + gain * diff * diff);
+            }
+            last_us[i] = r;
+        }
+    }
+
+    // In ms; HUGE_VAL until enough replies arrived, like the rtt.* window stats
+    double jitter_ms(size_t i) const { return replies[i] >= 2 ? jitter_us[i] / 1000.0 : HUGE_VAL; }
+    double mean_ms(size_t i) const { return replies[i] >= 1 ? mean_us[i] / 1000.0 : HUGE_VAL; }
+    double stddev_ms(size_t i) const { return replies[i] >= 2 ? sqrt(var_us2[i]) / 1000.0 : HUGE_VAL; }
+};
+
+// ---------------------------------------------------------
+// RTT BASELINE: a per-server median and MAD of the RTTs of the last
+// BASELINE_WINDOW_SECONDS, in constant memory. RTTs are counted in
+// log-spaced buckets (8 per octave, 8us .. 8s), one histogram per half
+// window; the older half is cleared when the newer one fills, so the
+// baseline covers between one half and one full window. Each sample gets a
+// robust z-score, (rtt - median) / (1.4826 * MAD), against the cached
+// baseline, which is recomputed from the histograms every REFRESH_TICKS
+// ticks, staggered across servers.
+struct RttBaseline {
+    static constexpr int PER_OCTAVE = 8;
+    static constexpr int BUCKETS = 20 * PER_OCTAVE;
+    static constexpr int REFRESH_TICKS = 10;
+    size_t servers = 0;
+    size_t half = 1;                    // ticks per half window
+    size_t ticks = 0;                   // in the current half
+    uint32_t current = 0;               // half being filled
+    uint64_t tick = 0;
+    vector<uint16_t> counts;            // [(h * servers + i) * BUCKETS + b]
+    vector<uint32_t> total;             // samples per server in both halves
+    vector<double> median_us, sigma_us; // cached baseline; sigma = 1.4826 * MAD, at least half a bucket
+    vector<double> score;               // of the last reply, 0 until BASELINE_MIN_SAMPLES
+    vector<uint32_t> merged;            // scratch: one server's two halves
+
+    static int bucket(int rtt_us) {
+        if (rtt_us < 8) return 0;
+        return min(int(PER_OCTAVE * log2(rtt_us / 8.0)), BUCKETS - 1);
+    }
+    static double value(double b) { return 8.0 * exp2(b / PER_OCTAVE); }   // b + 0.5 is a bucket's middle
+
+    void init(size_t n) {
+        servers = n;
+        half = size_t(max(BASELINE_WINDOW_SECONDS / 2, 1));
+        counts.assign(2 * n * BUCKETS, 0);
+        total.assign(n, 0);
+        median_us.assign(n, 0);
+        sigma_us.assign(n, 0);
+        score.assign(n, 0);
+        merged.assign(BUCKETS, 0);
+    }
+
+    uint16_t* hist(uint32_t h, size_t i) { return &counts[(h * servers + i) * BUCKETS]; }
+
+    // rtt_us may be null (ping engine): nothing is learned
+    void update_all(const int* rtt_us) {
+        if (!rtt_us) return;
+        if (ticks++ == half) {
+            current ^= 1;
+            ticks = 1;
+            for (size_t i = 0; i < servers; i++) {
+                uint16_t* h = hist(current, i);
+                for (int b = 0; b < BUCKETS; b++) total[i] -= h[b];
+                memset(h, 0, BUCKETS * sizeof(uint16_t));
+            }
+        }
+        tick++;
+        for (size_t i = 0; i < servers; i++) {
+            if ((tick + i) % REFRESH_TICKS == 0) refresh(i);
+            const int r = rtt_us[i];
+            if (r < 0) continue;
+            uint16_t& c = hist(current, i)[bucket(r)];
+            if (c != UINT16_MAX) {
+                c++;
+                total[i]++;
+            }
+            if (total[i] >= uint32_t(BASELINE_MIN_SAMPLES) && sigma_us[i] > 0)
+                score[i] = (r - median_us[i]) / sigma_us[i];
+        }
+    }
+
+    // Median bucket (interpolated inside it), then the median distance to
+    // it, walking outwards from the median on both sides in order of distance
+    void refresh(size_t i) {
+        if (total[i] == 0) return;
+        const uint16_t* a = hist(0, i);
+        const uint16_t* b = hist(1, i);
+        for (int k = 0; k < BUCKETS; k++) merged[k] = uint32_t(a[k]) + b[k];
+        const uint32_t mid = (total[i] + 1) / 2;
+        int m = 0;
+        uint32_t below = 0;
+        while (below + merged[m] < mid) below += merged[m++];
+        const double med = value(m + (mid - below - 0.5) / merged[m]);
+
+        uint32_t seen = merged[m];
+        double mad = 0;
+        for (int lo = m - 1, hi = m + 1; seen < mid;) {
+            const double dlo = lo >= 0 ? med - value(lo + 0.5) : HUGE_VAL;
+            const double dhi = hi < BUCKETS ? value(hi + 0.5) - med : HUGE_VAL;
+            if (dlo <= dhi) {
+                seen += merged[lo--];
+                mad = dlo;
+            } else {
+                seen += merged[hi++];
+                mad = dhi;
+            }
+        }
+        median_us[i] = med;
+        sigma_us[i] = max(1.4826 * mad, med * (exp2(1.0 / PER_OCTAVE) - 1) / 2);
+    }
+
+    // In ms; HUGE_VAL until BASELINE_MIN_SAMPLES replies, like the rtt.* window stats
+    bool ready(size_t i) const { return total[i] >= uint32_t(BASELINE_MIN_SAMPLES) && sigma_us[i] > 0; }
+    double median_ms(size_t i) const { return ready(i) ? median_us[i] / 1000.0 : HUGE_VAL; }
+    double mad_ms(size_t i) const { return ready(i) ? sigma_us[i] / 1.4826 / 1000.0 : HUGE_VAL; }
+};
+
+// ---------------------------------------------------------
+// TEXTFILE METRICS: a node_exporter textfile built in a buffer sized at
+// startup, written with write(2) and renamed into place, so rewriting it
+// does not allocate. Each series has its labels prebuilt by the caller.
+struct Textfile {
+    string path, tmp;
+    vector<char> buf;
+    size_t len = 0;
+
+    void init(const string& file, size_t capacity) {
+        path = file;
+        tmp = file + ".tmp";
+        buf.assign(capacity, 0);
+    }
+
+    void append(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list ap;
+        va_start(ap, fmt);
+        int w = vsnprintf(buf.data() + len, buf.size() - len, fmt, ap);
+        va_end(ap);
+        if (w > 0) len = min(len + size_t(w), buf.size() - 1);
+    }
+
+    // Prometheus has no infinity for "unknown"; NaN is its missing value
+    template <typename Value>
+    void gauge(const char* name, const char* help, const vector<string>& labels, Value value) {
+        append("# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+        for (size_t i = 0; i < labels.size(); i++) {
+            const double v = value(i);
+            if (isinf(v)) append("%s{%s} NaN\n", name, labels[i].c_str());
+            else append("%s{%s} %.3f\n", name, labels[i].c_str(), v);
+        }
+    }
+
+    void commit() {
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return;
+        const bool ok = ::write(fd, buf.data(), len) == ssize_t(len);
+        if (close(fd) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+        len = 0;
+    }
+};
+
+// PROBE METRICS: per-backend window loss, RTT mean and deviation, jitter and
+// baseline in STATE_DIR/probe.prom, rewritten every PROBE_METRICS_INTERVAL_S
+struct ProbeMetrics {
+    Textfile out;
+    vector<string> labels;              // per server: backend="..."[,path="..."]
+    steady_clock::time_point next{};
+
+    void init(const string& file, const vector<string>& servers, const vector<string>& paths) {
+        size_t size = 1024;
+        for (size_t i = 0; i < servers.size(); i++) {
+            labels.push_back("backend=\"" + servers[i] + "\"" + (paths[i].empty() ? "" : ",path=\"" + paths[i] + "\""));
+            size += 6 * (labels.back().size() + 64);
+        }
+        out.init(file, size);
+    }
+
+    template <typename Value>
+    void gauge(const char* name, const char* help, Value value) { out.gauge(name, help, labels, value); }
+
+    void write(steady_clock::time_point now, const int* avg, const JitterEstimator& j, const RttBaseline& base) {
+        if (now < next) return;
+        next = now + seconds(max(PROBE_METRICS_INTERVAL_S, 1));
+        gauge("lvs_monitor_backend_loss_percent", "Probe loss over the window.",
+              [&](size_t i) { return double(avg[i]); });
+        gauge("lvs_monitor_backend_rtt_ms", "Exponentially weighted echo round-trip time.",
+              [&](size_t i) { return j.mean_ms(i); });
+        gauge("lvs_monitor_backend_rtt_stddev_ms", "Exponentially weighted round-trip time deviation.",
+              [&](size_t i) { return j.stddev_ms(i); });
+        gauge("lvs_monitor_backend_jitter_ms", "RFC 3550 interarrival jitter of round-trip times.",
+              [&](size_t i) { return j.jitter_ms(i); });
+        gauge("lvs_monitor_backend_rtt_baseline_ms", "Learned median round-trip time.",
+              [&](size_t i) { return base.median_ms(i); });
+        gauge("lvs_monitor_backend_rtt_score", "Robust z-score of the last round-trip time against the baseline.",
+              [&](size_t i) { return base.score[i]; });
+        out.commit();
+    }
+};
+
+// ---------------------------------------------------------
+// HEALTH EXPRESSIONS
+// A service's `health` string is compiled once at startup into bytecode for a
+// small stack machine. Operands are constants or input slots; every input is
+// a double in a flat table indexed [slot * servers + server]. Evaluation uses
+// a fixed stack on the C stack, so it never allocates. && and || short-circuit
+// with conditional jumps that leave the deciding value on the stack.
+enum HealthSlot {
+    SLOT_ICMP_LOSS, SLOT_ICMP_LATEST,
+    SLOT_MTU_LOSS, SLOT_MTU_LATEST,
+    SLOT_RTT_JITTER, SLOT_RTT_STDDEV,
+    SLOT_RTT_SCORE, SLOT_RTT_BASELINE, SLOT_RTT_MAD,
+    SLOT_IPVS_SILENT, SLOT_IPVS_CPS,
+    SLOT_RTT_FIRST,                                 // RTT_STATS slots in RttStat order
+    SLOT_CHECK_FIRST = SLOT_RTT_FIRST + RTT_STATS   // then (ok, status) per check
+};
+
+enum HealthOp : uint8_t {
+    H_CONST, H_LOAD,
+    H_LT, H_LE, H_GT, H_GE, H_EQ, H_NE, H_NOT,
+    H_JFALSE,   // top == 0: jump, else pop
+    H_JTRUE     // top != 0: jump, else pop
+};
+
+struct HealthInsn {
+    HealthOp op;
+    uint16_t arg;   // constant index, slot, or jump target
+};
+
+const int HEALTH_STACK = 16;
+
+struct HealthProgram {
+    vector<HealthInsn> code;    // empty: use the loss-window verdict
+    vector<double> consts;
+    vector<uint16_t> slots;     // input slots read by the program
+};
+
+bool eval_health(const HealthProgram& p, const double* inputs, size_t servers, size_t server) {
+    double stack[HEALTH_STACK];
+    int sp = 0;
+    const size_t n = p.code.size();
+    for (size_t pc = 0; pc < n; pc++) {
+        const HealthInsn in = p.code[pc];
+        switch (in.op) {
+        case H_CONST: stack[sp++] = p.consts[in.arg]; break;
+        case H_LOAD:  stack[sp++] = inputs[size_t(in.arg) * servers + server]; break;
+        case H_LT: sp--; stack[sp - 1] = stack[sp - 1] <  stack[sp]; break;
+        case H_LE: sp--; stack[sp - 1] = stack[sp - 1] <= stack[sp]; break;
+        case H_GT: sp--; stack[sp - 1] = stack[sp - 1] >  stack[sp]; break;
+        case H_GE: sp--; stack[sp - 1] = stack[sp - 1] >= stack[sp]; break;
+        case H_EQ: sp--; stack[sp - 1] = stack[sp - 1] == stack[sp]; break;
+        case H_NE: sp--; stack[sp - 1] = stack[sp - 1] != stack[sp]; break;
+        case H_NOT: stack[sp - 1] = stack[sp - 1] == 0; break;
+        case H_JFALSE:
+            if (stack[sp - 1] == 0) pc = size_t(in.arg) - 1;
+            else sp--;
+            break;
+        case H_JTRUE:
+            if (stack[sp - 1] != 0) pc = size_t(in.arg) - 1;
+            else sp--;
+            break;
+        }
+    }
+    return sp > 0 && stack[sp - 1] != 0;
+}
+
+// Recursive-descent compiler, emitting code as it parses:
+//   or  := and ('||' and)*        and := not ('&&' not)*
+//   not := '!' not | cmp          cmp := term (op term)?
+//   term := number [us|ms|s|%] | name.field | '(' or ')'
+struct HealthCompiler {
+    const string& src;
+    const vector<CheckConfig>& checks;
+    HealthProgram& out;
+    size_t pos = 0;
+    int depth = 0, max_depth = 0;
+    string error;
+
+    HealthCompiler(const string& s, const vector<CheckConfig>& c, HealthProgram& p) : src(s), checks(c), out(p) {}
+
+    void skip_space() {
+        while (pos < src.size() && isspace((unsigned char)src[pos])) pos++;
+    }
+
+    bool accept(const char* tok) {
+        skip_space();
+        size_t len = strlen(tok);
+        if (src.compare(pos, len, tok) != 0) return false;
+        // "<" must not swallow the start of "<=", "!" not the start of "!="
+        if (len == 1 && pos + 1 < src.size() && src[pos + 1] == '=' && strchr("<>!=", tok[0])) return false;
+        pos += len;
+        return true;
+    }
+
+    bool fail(const string& msg) {
+        if (error.empty()) error = msg + " at offset " + to_string(pos);
+        return false;
+    }
+
+    void emit(HealthOp op, uint16_t arg = 0) {
+        out.code.push_back(HealthInsn{op, arg});
+        if (op == H_CONST || op == H_LOAD) max_depth = max(max_depth, ++depth);
+        else if (op != H_NOT && op != H_JFALSE && op != H_JTRUE) depth--;
+    }
+
+    bool resolve(const string& name, uint16_t* slot) {
+        size_t dot = name.rfind('.');
+        if (dot == string::npos) return fail("expected <source>.<field>, got '" + name + "'");
+        string src_name = name.substr(0, dot), field = name.substr(dot + 1);
+        if (src_name == "icmp") {
+            if (field == "loss") *slot = SLOT_ICMP_LOSS;
+            else if (field == "latest") *slot = SLOT_ICMP_LATEST;
+            else return fail("unknown icmp field '" + field + "'");
+            return true;
+        }
+        if (src_name == "mtu") {
+            if (field == "loss") *slot = SLOT_MTU_LOSS;
+            else if (field == "latest") *slot = SLOT_MTU_LATEST;
+            else return fail("unknown mtu field '" + field + "'");
+            return true;
+        }
+        if (src_name == "ipvs") {
+            if (field == "silent") *slot = SLOT_IPVS_SILENT;
+            else if (field == "cps") *slot = SLOT_IPVS_CPS;
+            else return fail("unknown ipvs field '" + field + "'");
+            return true;
+        }
+        if (src_name == "rtt") {
+            static const pair<const char*, HealthSlot> learned[] = {
+                {"jitter", SLOT_RTT_JITTER}, {"stddev", SLOT_RTT_STDDEV},
+                {"score", SLOT_RTT_SCORE}, {"baseline", SLOT_RTT_BASELINE}, {"mad", SLOT_RTT_MAD}};
+            for (const auto& [n, sl] : learned) {
+                if (field == n) {
+                    *slot = sl;
+                    return true;
+                }
+            }
+            static const char* names[RTT_STATS] = {"last", "avg", "p50", "p90", "p99", "max"};
+            for (int st = 0; st < RTT_STATS; st++) {
+                if (field == names[st]) {
+                    *slot = uint16_t(SLOT_RTT_FIRST + st);
+                    return true;
+                }
+            }
+            return fail("unknown rtt field '" + field + "'");
+        }
+        for (size_t c = 0; c < checks.size(); c++) {
+            if (checks[c].name != src_name) continue;
+            if (field == "ok") *slot = uint16_t(SLOT_CHECK_FIRST + 2 * c);
+            else if (field == "status") *slot = uint16_t(SLOT_CHECK_FIRST + 2 * c + 1);
+            else return fail("unknown check field '" + field + "'");
+            return true;
+        }
+        return fail("unknown input '" + name + "'");
+    }
+
+    bool term() {
+        skip_space();
+        if (accept("(")) {
+            if (!parse_or()) return false;
+            return accept(")") || fail("expected ')'");
+        }
+        if (pos < src.size() && (isdigit((unsigned char)src[pos]) || src[pos] == '.')) {
+            char* end = nullptr;
+            double v = strtod(src.c_str() + pos, &end);
+            pos = end - src.c_str();
+            if (accept("us")) v /= 1000.0;          // times compare in ms
+            else if (accept("ms")) {}
+            else if (accept("s")) v *= 1000.0;
+            else accept("%");
+            out.consts.push_back(v);
+            emit(H_CONST, uint16_t(out.consts.size() - 1));
+            return true;
+        }
+        size_t start = pos;
+        while (pos < src.size() && (isalnum((unsigned char)src[pos]) || strchr("_.-", src[pos]))) pos++;
+        if (pos == start) return fail("expected a value");
+        uint16_t slot = 0;
+        if (!resolve(src.substr(start, pos - start), &slot)) return false;
+        if (find(out.slots.begin(), out.slots.end(), slot) == out.slots.end()) out.slots.push_back(slot);
+        emit(H_LOAD, slot);
+        return true;
+    }
+
+    bool cmp() {
+        if (!term()) return false;
+        static const struct { const char* tok; HealthOp op; } ops[] = {
+            {"<=", H_LE}, {">=", H_GE}, {"==", H_EQ}, {"!=", H_NE}, {"<", H_LT}, {">", H_GT}};
+        for (const auto& o : ops) {
+            if (!accept(o.tok)) continue;
+            if (!term()) return false;
+            emit(o.op);
+            return true;
+        }
+        return true;
+    }
+
+    bool parse_not() {
+        if (accept("!")) {
+            if (!parse_not()) return false;
+            emit(H_NOT);
+            return true;
+        }
+        return cmp();
+    }
+
+    bool chain(const char* tok, HealthOp jump, bool (HealthCompiler::*operand)()) {
+        if (!(this->*operand)()) return false;
+        vector<size_t> fixups;
+        while (accept(tok)) {
+            fixups.push_back(out.code.size());
+            emit(jump);
+            depth--;                            // the jump pops when it falls through
+            if (!(this->*operand)()) return false;
+        }
+        for (size_t at : fixups) out.code[at].arg = uint16_t(out.code.size());
+        return true;
+    }
+
+    bool parse_and() { return chain("&&", H_JFALSE, &HealthCompiler::parse_not); }
+    bool parse_or() { return chain("||", H_JTRUE, &HealthCompiler::parse_and); }
+
+    bool compile() {
+        if (!parse_or()) return false;
+        skip_space();
+        if (pos != src.size()) return fail("unexpected '" + src.substr(pos, 1) + "'");
+        if (max_depth > HEALTH_STACK) return fail("expression too deep");
+        return true;
+    }
+};
+
+// ---------------------------------------------------------
+// KEEPALIVED IMPORT
+// Reads the virtual_server / real_server blocks of a keepalived.conf into
+// ServiceConfig and CheckConfig entries. One pass over the tokens builds
+// everything and collects every problem with its file and line, so a large
+// config is validated in a single run. Virtual servers on the same VIP with
+// the same real servers, sorry server and checks become one service with
+// several ports. Each distinct TCP_CHECK, HTTP_GET, SMTP_CHECK or MISC_CHECK
+// becomes one check limited to the real servers that declared it, and a
+// service's health expression is the conjunction of its checks (plus
+// icmp.loss for PING_CHECK); like keepalived, a checked service ignores ICMP.
+struct KaToken {
+    string text;
+    uint32_t file;
+    uint32_t line;
+};
+
+struct KeepalivedImport {
+    vector<string> files;
+    vector<KaToken> toks;
+    size_t pos = 0;
+    vector<string> errors, warnings;
+
+    vector<CheckConfig> checks;
+    map<string, uint32_t> check_index;  // "type|port|path|expect" -> checks[]
+    vector<ServiceConfig> services;
+    map<string, uint32_t> service_index;
+    map<string, uint32_t> vip_services;
+
+    bool tokenize(const string& path, int depth) {
+        if (depth > 8) {
+            errors.push_back(path + ": includes nested too deeply");
+            return false;
+        }
+        FILE* f = fopen(path.c_str(), "r");
+        if (!f) {
+            errors.push_back(path + ": " + strerror(errno));
+            return false;
+        }
+        string text;
+        char buf[65536];
+        size_t got;
+        while ((got = fread(buf, 1, sizeof(buf), f)) > 0) text.append(buf, got);
+        fclose(f);
+
+        const uint32_t file = uint32_t(files.size());
+        files.push_back(path);
+        uint32_t line = 1;
+        for (size_t at = 0; at < text.size();) {
+            char c = text[at];
+            if (c == '\n') line++;
+            if (isspace((unsigned char)c)) {
+                at++;
+            } else if (c == '#' || c == '!') {
+                while (at < text.size() && text[at] != '\n') at++;
+            } else if (c == '{' || c == '}') {
+                toks.push_back({string(1, c), file, line});
+                at++;
+            } else if (c == '"') {
+                size_t end = text.find('"', at + 1);
+                if (end == string::npos) end = text.size();
+                toks.push_back({text.substr(at + 1, end - at - 1), file, line});
+                for (size_t k = at; k < end; k++) line += text[k] == '\n';
+                at = end + 1;
+            } else {
+                size_t start = at;
+                while (at < text.size() && !isspace((unsigned char)text[at]) && !strchr("{}#!\"", text[at])) at++;
+                toks.push_back({text.substr(start, at - start), file, line});
+            }
+
+            // include <glob>, relative to the including file
+            if (toks.size() >= 2 && toks[toks.size() - 2].text == "include" && toks[toks.size() - 2].file == file &&
+                toks.back().text != "{" && toks.back().text != "}") {
+                string pattern = toks.back().text;
+                toks.resize(toks.size() - 2);
+                if (pattern[0] != '/') pattern = path.substr(0, path.rfind('/') + 1) + pattern;
+                glob_t g;
+                if (glob(pattern.c_str(), 0, nullptr, &g) == 0) {
+                    for (size_t k = 0; k < g.gl_pathc; k++) tokenize(g.gl_pathv[k], depth + 1);
+                    globfree(&g);
+                } else {
+                    warnings.push_back(path + ":" + to_string(line) + ": include " + pattern + " matches nothing");
+                }
+            }
+        }
+        return true;
+    }
+
+    string where(size_t at) const {
+        const KaToken& t = toks[min(at, toks.size() - 1)];
+        return files[t.file] + ":" + to_string(t.line) + ": ";
+    }
+    void error(size_t at, const string& msg) { errors.push_back(where(at) + msg); }
+    void warn(size_t at, const string& msg) { warnings.push_back(where(at) + msg); }
+
+    bool at_end() const { return pos >= toks.size(); }
+    const string& peek() const {
+        static const string none;
+        return at_end() ? none : toks[pos].text;
+    }
+    string next() { return at_end() ? string() : toks[pos++].text; }
+
+    // Skips a balanced { ... } if one starts here
+    void skip_block() {
+        if (peek() != "{") return;
+        int depth = 0;
+        do {
+            const string& t = next();
+            depth += t == "{";
+            depth -= t == "}";
+        } while (depth > 0 && !at_end());
+    }
+
+    // Skips a keyword's values, or its block
+    void skip_item() {
+        while (!at_end() && peek() != "{" && peek() != "}" && !isalpha((unsigned char)peek()[0])) pos++;
+        skip_block();
+    }
+
+    bool open_block(const char* what) {
+        if (next() == "{") return true;
+        error(pos - 1, string("expected '{' after ") + what);
+        return false;
+    }
+
+    int parse_port(size_t at, const string& s) {
+        char* end = nullptr;
+        long port = strtol(s.c_str(), &end, 10);
+        if (s.empty() || *end || port < 1 || port > 65535) {
+            error(at, "bad port '" + s + "'");
+            return 0;
+        }
+        return int(port);
+    }
+
+    bool parse_ipv4(size_t at, const string& s) {
+        in_addr a;
+        if (inet_pton(AF_INET, s.c_str(), &a) == 1) return true;
+        error(at, "'" + s + "' is not an IPv4 address");
+        return false;
+    }
+
+    uint32_t add_check(const string& type, int port, const string& path, int expect, const string& ip) {
+        const string key = type + "|" + to_string(port) + "|" + path + "|" + to_string(expect);
+        auto it = check_index.find(key);
+        if (it == check_index.end()) {
+            string base = (type == "script" ? "misc" : type) + to_string(port), name = base;
+            for (int k = 2; any_of(checks.begin(), checks.end(), [&](const CheckConfig& c) { return c.name == name; }); k++)
+                name = base + "_" + to_string(k);
+            it = check_index.emplace(key, uint32_t(checks.size())).first;
+            checks.push_back(CheckConfig{name, type, port, path, expect});
+        }
+        CheckConfig& c = checks[it->second];
+        if (find(c.servers.begin(), c.servers.end(), ip) == c.servers.end()) c.servers.push_back(ip);
+        return it->second;
+    }
+
+    // One checker block of a real_server; adds its check indices to `used`
+    void parse_checker(const string& kind, const string& ip, int rs_port, set<uint32_t>& used, bool& ping) {
+        const size_t at = pos - 1;
+        if (kind == "PING_CHECK") {
+            ping = true;
+            skip_block();
+            return;
+        }
+        if (kind != "TCP_CHECK" && kind != "HTTP_GET" && kind != "SMTP_CHECK" && kind != "MISC_CHECK") {
+            error(at, kind + " is not supported (TCP_CHECK, HTTP_GET, SMTP_CHECK, MISC_CHECK and PING_CHECK are)");
+            skip_block();
+            return;
+        }
+        if (!open_block(kind.c_str())) return;
+
+        int port = kind == "SMTP_CHECK" ? 25 : rs_port;
+        string script;
+        vector<pair<string, int>> urls;
+        while (!at_end() && peek() != "}") {
+            const size_t kat = pos;
+            const string key = next();
+            if (key == "connect_port") {
+                port = parse_port(pos, next());
+            } else if (key == "misc_path") {
+                script = next();
+            } else if (key == "url") {
+                if (!open_block("url")) return;
+                string path = "/";
+                int status = 200;
+                while (!at_end() && peek() != "}") {
+                    const string k = next();
+                    if (k == "path") path = next();
+                    else if (k == "status_code") status = atoi(next().c_str());
+                    else {
+                        if (k == "digest") warn(pos - 1, "url digest is not checked, only the status code");
+                        skip_item();
+                    }
+                }
+                next();
+                urls.push_back({path, status});
+            } else if (key == "connect_ip" || key == "bindto" || key == "host") {
+                error(kat, key + " is not supported; checks always go to the real server");
+                skip_item();
+            } else {
+                skip_item();    // timeouts, retries, delay_before_retry: CHECK_TIMEOUT_MS applies
+            }
+        }
+        next();
+
+        if (port == 0) return;
+        if (kind == "TCP_CHECK") {
+            used.insert(add_check("tcp", port, "/", 200, ip));
+        } else if (kind == "SMTP_CHECK") {
+            used.insert(add_check("smtp", port, "/", 200, ip));
+        } else if (kind == "HTTP_GET") {
+            if (urls.empty()) error(at, "HTTP_GET without a url block");
+            for (const auto& u : urls) used.insert(add_check("http", port, u.first, u.second, ip));
+        } else if (script.empty()) {
+            error(at, "MISC_CHECK without misc_path");
+        } else if (script[0] != '/' || script.find_first_of(" \t") != string::npos) {
+            error(at, "misc_path must be an absolute path without arguments; the script is run as `" +
+                          script.substr(0, script.find_first_of(" \t")) + " <server-ip> <port>`");
+        } else {
+            used.insert(add_check("script", port, script, 0, ip));
+        }
+    }
+
+    void parse_virtual_server() {
+        const size_t at = pos - 1;
+        const string vip = next();
+        if (vip == "fwmark" || vip == "group") {
+            error(at, "virtual_server " + vip + " is not supported, only <ip> <port>");
+            skip_item();
+            return;
+        }
+        const string port_s = next();
+        const bool vip_ok = parse_ipv4(at, vip);
+        const int port = parse_port(at, port_s);
+        if (!open_block("virtual_server")) return;
+
+        bool udp = false, ping = false;
+        string sorry;
+        vector<string> reals;
+        set<uint32_t> used;
+        while (!at_end() && peek() != "}") {
+            const size_t kat = pos;
+            const string key = next();
+            if (key == "protocol") {
+                const string p = next();
+                if (p == "UDP") udp = true;
+                else if (p != "TCP") error(kat, "protocol " + p + " is not supported");
+            } else if (key == "lb_kind") {
+                if (next() != "NAT") warn(kat, "lb_kind is ignored, destinations are always added as NAT (-m)");
+            } else if (key == "sorry_server") {
+                sorry = next();
+                parse_ipv4(kat, sorry);
+                if (!isalpha((unsigned char)peek()[0]) && peek() != "}" && parse_port(kat, next()) != port)
+                    error(kat, "sorry_server port must match the virtual server port");
+            } else if (key == "real_server") {
+                const string ip = next();
+                const string rs_port = next();
+                bool ok = parse_ipv4(kat, ip);
+                int p = parse_port(kat, rs_port);
+                if (p && port && p != port) {
+                    error(kat, "real_server port " + rs_port + " differs from the virtual server port " + port_s +
+                                   "; ports are not remapped");
+                    ok = false;
+                }
+                if (!open_block("real_server")) return;
+                while (!at_end() && peek() != "}") {
+                    const string k = next();
+                    if (k == "HTTP_GET" || k == "SSL_GET" || (k.size() > 6 && k.compare(k.size() - 6, 6, "_CHECK") == 0))
+                        parse_checker(k, ip, p, used, ping);
+                    else
+                        skip_item();    // weight, inhibit_on_failure, notify scripts
+                }
+                next();
+                if (ok && find(reals.begin(), reals.end(), ip) == reals.end()) reals.push_back(ip);
+            } else {
+                skip_item();    // lb_algo, delay_loop, persistence, quorum ...
+            }
+        }
+        next();
+        if (!vip_ok || !port) return;
+        if (reals.empty()) warn(at, "virtual_server " + vip + " " + port_s + " has no real servers");
+
+        // Merge with a service on the same VIP that has the same pool and checks
+        string key = vip + "|" + sorry + "|" + (ping ? "ping" : "");
+        vector<string> sorted_reals = reals;
+        sort(sorted_reals.begin(), sorted_reals.end());
+        for (const auto& r : sorted_reals) key += "|" + r;
+        key += "|";
+        for (uint32_t c : used) key += to_string(c) + ",";
+
+        auto it = service_index.find(key);
+        if (it == service_index.end()) {
+            uint32_t count = vip_services[vip]++;
+            ServiceConfig sc;
+            sc.name = count ? vip + "#" + to_string(count + 1) : vip;
+            sc.vip = vip;
+            sc.backends = reals;
+            sc.sorry_server = sorry;
+            for (uint32_t c : used) sc.health += (sc.health.empty() ? "" : " && ") + checks[c].name + ".ok";
+            if (ping) sc.health = "icmp.loss < " + to_string(LOSS_THRESHOLD) + (sc.health.empty() ? "" : " && " + sc.health);
+            it = service_index.emplace(key, uint32_t(services.size())).first;
+            services.push_back(move(sc));
+        }
+        auto& ports = udp ? services[it->second].udp_ports : services[it->second].tcp_ports;
+        if (find(ports.begin(), ports.end(), port_s) != ports.end())
+            error(at, "virtual_server " + vip + " " + port_s + (udp ? " UDP" : " TCP") + " is defined twice");
+        else
+            ports.push_back(port_s);
+    }
+
+    bool load(const string& path) {
+        tokenize(path, 0);
+        while (!at_end()) {
+            const size_t at = pos;
+            const string key = next();
+            if (key == "virtual_server") parse_virtual_server();
+            else if (key == "virtual_server_group") {
+                error(at, "virtual_server_group is not supported");
+                skip_item();
+            } else skip_item();
+        }
+        for (auto& sc : services) {
+            sc.tcp_ports = compress_ports(sc.tcp_ports);
+            sc.udp_ports = compress_ports(sc.udp_ports);
+        }
+        return errors.empty();
+    }
+
+    // "80", "81", "82" -> "80-82"
+    static vector<string> compress_ports(const vector<string>& raw) {
+        vector<int> p;
+        for (const auto& s : raw) p.push_back(atoi(s.c_str()));
+        sort(p.begin(), p.end());
+        vector<string> out;
+        for (size_t k = 0; k < p.size();) {
+            size_t e = k;
+            while (e + 1 < p.size() && p[e + 1] == p[e] + 1) e++;
+            out.push_back(e > k ? to_string(p[k]) + "-" + to_string(p[e]) : to_string(p[k]));
+            k = e + 1;
+        }
+        return out;
+    }
+};
+
+string cpp_string(const string& s) {
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+string cpp_list(const vector<string>& v) {
+    string out = "{";
+    for (size_t k = 0; k < v.size(); k++) out += (k ? ", " : "") + cpp_string(v[k]);
+    return out + "}";
+}
+
+// ---------------------------------------------------------
+// IMPORT: lvs_monitor import <keepalived.conf>
+// Validates the file and prints the CHECKS and SERVICES it maps to, ready to
+// paste into the CONFIG section (or set KEEPALIVED_CONF to load it at startup).
+int import_keepalived(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s import <keepalived.conf>\n", argv[0]);
+        return 2;
+    }
+    auto start = steady_clock::now();
+    KeepalivedImport ka;
+    bool ok = ka.load(argv[2]);
+    auto took = duration_cast<microseconds>(steady_clock::now() - start).count();
+    for (const auto& w : ka.warnings) fprintf(stderr, "warning: %s\n", w.c_str());
+    for (const auto& e : ka.errors) fprintf(stderr, "error: %s\n", e.c_str());
+    fprintf(stderr, "%zu tokens in %zu files, %zu services, %zu checks, %zu errors, %.1f ms\n", ka.toks.size(),
+            ka.files.size(), ka.services.size(), ka.checks.size(), ka.errors.size(), took / 1000.0);
+    if (!ok) return 1;
+
+    printf("vector<CheckConfig> CHECKS = {\n");
+    for (const auto& c : ka.checks)
+        printf("    {%s, %s, %d, %s, %d, %s},\n", cpp_string(c.name).c_str(), cpp_string(c.type).c_str(), c.port,
+               cpp_string(c.path).c_str(), c.expect, cpp_list(c.servers).c_str());
+    printf("};\n\nvector<ServiceConfig> SERVICES = {\n");
+    for (const auto& s : ka.services)
+        printf("    {%s, %s, %s, %s, %s, %s, {}, %s},\n", cpp_string(s.name).c_str(), cpp_string(s.vip).c_str(),
+               cpp_list(s.tcp_ports).c_str(), cpp_list(s.udp_ports).c_str(), cpp_list(s.backends).c_str(),
+               cpp_string(s.health).c_str(), cpp_string(s.sorry_server).c_str());
+    printf("};\n");
+    return 0;
+}
+
+// ---------------------------------------------------------
+// SERVICES
+// Each service is a VIP with its ports, backends and compiled health program.
+// A backend shared by several services is probed once: probes and checks run
+// per server (the union of all backends), decisions per (service, server) member.
+//
+// Members are primaries, backups or the sorry server. A primary's health
+// verdict is its desired state. Backups and the sorry server are failover
+// tiers: their desired state follows the health of the primary pool, and a
+// service's tiers are re-evaluated only in ticks where one of its members'
+// verdicts changed, so the swap lands in that tick's kernel batch.
+enum MemberRole : uint8_t { ROLE_PRIMARY = 0, ROLE_BACKUP = 1, ROLE_SORRY = 2 };
+
+struct Service {
+    string name;
+    string vip;
+    vector<int> tcp_ports, udp_ports;
+    HealthProgram health;
+    vector<uint32_t> members;
+    uint32_t netns = 0;                 // index into `netns`
+    int min_healthy = 1;
+    bool tiered = false;                // has backups or a sorry server
+    bool failover = false;              // backups in use
+};
+
+vector<Service> services;
+vector<string> servers;                 // probed addresses
+vector<uint32_t> server_path;           // probe path of each server; the same address on two paths is two servers
+vector<int> server_mtu;                 // largest probe_mtu of the server's services, 0 = none
+vector<uint32_t> member_service, member_server;
+vector<uint8_t> member_role;
+vector<uint8_t> member_health;          // verdict for the member's server in its service
+vector<uint8_t> member_state;           // desired state in the kernel table
+vector<uint32_t> server_members;        // members of server i: server_members[i] .. [i + 1] in member_order
+vector<uint32_t> member_order;
+
+bool build_services() {
+    vector<ServiceConfig> cfg = SERVICES;
+    if (cfg.empty())
+        cfg.push_back(ServiceConfig{"LVS", LVS_VIRTUAL_IP, TCP_SERVICES, UDP_SERVICES, BACKEND_SERVERS, "",
+                                    BACKUP_SERVERS, SORRY_SERVER, MIN_HEALTHY_BACKENDS});
+
+    map<string, uint32_t> index;
+    for (const auto& sc : cfg) {
+        Service svc;
+        svc.name = sc.name;
+        svc.vip = sc.vip;
+        svc.tcp_ports = expand_ports(sc.tcp_ports);
+        svc.udp_ports = expand_ports(sc.udp_ports);
+        if (!sc.health.empty()) {
+            HealthCompiler hc(sc.health, CHECKS, svc.health);
+            if (!hc.compile()) {
+                cout << "[ERROR] Service " << sc.name << ": bad health expression: " << hc.error << endl;
+                return false;
+            }
+            cout << "[INFO] Service " << sc.name << " health: " << sc.health
+                 << " (" << svc.health.code.size() << " ops)" << endl;
+        }
+
+        svc.min_healthy = sc.min_healthy;
+        svc.tiered = !sc.backup.empty() || !sc.sorry_server.empty();
+        if (!sc.netns.empty()) {
+            int ns = netns.index(sc.netns);
+            if (ns < 0) {
+                cout << "[ERROR] Service " << sc.name << ": cannot open network namespace " << sc.netns << ": "
+                     << strerror(errno) << endl;
+                return false;
+            }
+            svc.netns = uint32_t(ns);
+        }
+        if (sc.probe_mtu != 0 && (sc.probe_mtu < 576 || sc.probe_mtu > 65535)) {
+            cout << "[ERROR] Service " << sc.name << ": probe_mtu must be 0 or 576..65535" << endl;
+            return false;
+        }
+        const int path = probe_path_index(svc.netns, sc.probe_interface, sc.probe_source);
+        if (path < 0) {
+            cout << "[ERROR] Service " << sc.name << ": probe_source is not an IPv4 address: " << sc.probe_source
+                 << endl;
+            return false;
+        }
+
+        auto add_member = [&](const string& ip, MemberRole role) {
+            const string key = to_string(path) + "|" + ip;
+            auto it = index.find(key);
+            if (it == index.end()) {
+                it = index.emplace(key, uint32_t(servers.size())).first;
+                servers.push_back(ip);
+                server_path.push_back(uint32_t(path));
+                server_mtu.push_back(0);
+            }
+            server_mtu[it->second] = max(server_mtu[it->second], sc.probe_mtu);
+            svc.members.push_back(uint32_t(member_service.size()));
+            member_service.push_back(uint32_t(services.size()));
+            member_server.push_back(it->second);
+            member_role.push_back(role);
+        };
+        for (const auto& ip : sc.backends) add_member(ip, ROLE_PRIMARY);
+        for (const auto& ip : sc.backup) add_member(ip, ROLE_BACKUP);
+        if (!sc.sorry_server.empty()) add_member(sc.sorry_server, ROLE_SORRY);
+        services.push_back(move(svc));
+    }
+    member_health.assign(member_service.size(), STATE_UNKNOWN);
+    member_state.assign(member_service.size(), STATE_UNKNOWN);
+
+    // Group members by server so a server's inputs reach only its own members
+    server_members.assign(servers.size() + 1, 0);
+    for (uint32_t s : member_server) server_members[s + 1]++;
+    for (size_t i = 0; i < servers.size(); i++) server_members[i + 1] += server_members[i];
+    member_order.assign(member_server.size(), 0);
+    vector<uint32_t> fill(server_members.begin(), server_members.end() - 1);
+    for (size_t m = 0; m < member_server.size(); m++) member_order[fill[member_server[m]]++] = uint32_t(m);
+    return true;
+}
+
+// Per-tick inputs of the health programs. A value is rewritten only when it
+// differs from the last tick, which marks the server dirty; only dirty
+// servers (or ones whose loss-window verdict flipped) are re-evaluated.
+struct HealthInputs {
+    size_t servers = 0;
+    bool active = false;                // some service has a program
+    vector<uint8_t> used;               // per slot
+    vector<double> values;              // [slot * servers + server], NaN until first set
+    vector<uint64_t> dirty;             // bitmap of servers whose inputs changed this tick
+    bool separate_icmp = false;         // icmp.loss needs its own window (checks share the main one)
+    PackedLossWindows icmp_windows;
+    vector<uint8_t> icmp_lost;
+    vector<uint32_t> icmp_sum;
+    PackedLossWindows mtu_windows;      // large echoes, only when mtu.loss is used
+    vector<uint8_t> mtu_lost;
+    vector<uint32_t> mtu_sum;
+    bool need_rtt = false;
+    RttWindows rtt;
+
+    void init(size_t n) {
+        servers = n;
+        used.assign(SLOT_CHECK_FIRST + 2 * CHECKS.size(), 0);
+        for (const auto& svc : services) {
+            active |= !svc.health.code.empty();
+            for (uint16_t slot : svc.health.slots) used[slot] = 1;
+        }
+        dirty.assign((n + 63) / 64, 0);
+        if (!active) return;
+        values.assign(used.size() * n, NAN);
+
+        separate_icmp = used[SLOT_ICMP_LOSS] && !CHECKS.empty();
+        if (separate_icmp) {
+            icmp_windows.init(n, WINDOW_SECONDS);
+            icmp_lost.assign(n, 0);
+            icmp_sum.assign(n, 0);
+        }
+        if (used[SLOT_MTU_LOSS]) {
+            mtu_windows.init(n, WINDOW_SECONDS);
+            mtu_lost.assign(n, 0);
+            mtu_sum.assign(n, 0);
+        }
+        for (int st = 0; st < RTT_STATS; st++) need_rtt |= used[SLOT_RTT_FIRST + st] != 0;
+        if (need_rtt) rtt.init(n, WINDOW_SECONDS);
+    }
+
+    void set(size_t slot, size_t i, double v) {
+        double& cur = values[slot * servers + i];
+        if (cur == v) return;
+        cur = v;
+        dirty[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    // rtt_us may be null (ping engine), mtu_loss too (no large echoes). loss_sum is the main window.
+    void update(const int* latest, const int* rtt_us, const int* mtu_loss, const uint32_t* loss_sum,
+                uint32_t samples, const JitterEstimator& jitter, const RttBaseline& baseline,
+                const uint8_t* ipvs_silent, const double* ipvs_cps, const CheckRunner& checks) {
+        for (auto& w : dirty) w = 0;
+        if (!active) return;
+
+        const uint32_t* icmp = loss_sum;
+        if (separate_icmp) {
+            for (size_t i = 0; i < servers; i++) icmp_lost[i] = latest[i] > 0;
+            icmp_windows.push_all(icmp_lost.data(), icmp_sum.data());
+            icmp = icmp_sum.data();
+        }
+        if (used[SLOT_MTU_LOSS]) {
+            for (size_t i = 0; i < servers; i++) mtu_lost[i] = mtu_loss && mtu_loss[i] > 0;
+            mtu_windows.push_all(mtu_lost.data(), mtu_sum.data());
+        }
+        if (need_rtt) rtt.push_all(rtt_us);
+
+        double stats[RTT_STATS];
+        for (size_t i = 0; i < servers; i++) {
+            if (used[SLOT_ICMP_LOSS]) set(SLOT_ICMP_LOSS, i, double(icmp[i]) / samples);
+            if (used[SLOT_ICMP_LATEST]) set(SLOT_ICMP_LATEST, i, latest[i]);
+            if (used[SLOT_MTU_LOSS]) set(SLOT_MTU_LOSS, i, double(mtu_sum[i]) / samples);
+            if (used[SLOT_MTU_LATEST]) set(SLOT_MTU_LATEST, i, mtu_loss ? mtu_loss[i] : 0);
+            if (used[SLOT_RTT_JITTER]) set(SLOT_RTT_JITTER, i, jitter.jitter_ms(i));
+            if (used[SLOT_RTT_STDDEV]) set(SLOT_RTT_STDDEV, i, jitter.stddev_ms(i));
+            if (used[SLOT_RTT_SCORE]) set(SLOT_RTT_SCORE, i, baseline.score[i]);
+            if (used[SLOT_RTT_BASELINE]) set(SLOT_RTT_BASELINE, i, baseline.median_ms(i));
+            if (used[SLOT_RTT_MAD]) set(SLOT_RTT_MAD, i, baseline.mad_ms(i));
+            if (used[SLOT_IPVS_SILENT]) set(SLOT_IPVS_SILENT, i, ipvs_silent[i]);
+            if (used[SLOT_IPVS_CPS]) set(SLOT_IPVS_CPS, i, ipvs_cps[i]);
+            if (need_rtt) {
+                rtt.summarize(i, stats);
+                for (int st = 0; st < RTT_STATS; st++)
+                    if (used[SLOT_RTT_FIRST + st]) set(SLOT_RTT_FIRST + st, i, stats[st]);
+            }
+            for (size_t c = 0; c < CHECKS.size(); c++) {
+                size_t slot = SLOT_CHECK_FIRST + 2 * c;
+                if (used[slot]) set(slot, i, checks.passed(c, i));
+                if (used[slot + 1]) set(slot + 1, i, checks.status_of(c, i));
+            }
+        }
+    }
+};
+
+// ---------------------------------------------------------
+// OUTLIER DETECTION
+// Envoy-style ejection within a pool (a service's primaries). Every
+// OUTLIER_INTERVAL_S each pool's healthy primaries are compared: a backend
+// whose success rate (100 - window loss) is below the pool mean by more than
+// OUTLIER_STDEV_FACTOR standard deviations, or whose RTT is more than
+// OUTLIER_LATENCY_FACTOR times the pool median, is ejected for
+// OUTLIER_BASE_EJECTION_S times its ejection count. Both also need an
+// absolute gap (OUTLIER_MIN_SUCCESS_GAP, OUTLIER_MIN_LATENCY_MS): in a clean
+// pool one lost sample is sqrt(N - 1) deviations out, and 0.7ms against a
+// 0.2ms median is three times slower but harmless. The count drops by one
+// per interval the backend spends in the pool without being an outlier. At
+// most OUTLIER_MAX_EJECTION_PERCENT of a pool is ejected at once. Pools are
+// aggregated in one pass over their members with preallocated scratch.
+struct OutlierDetector {
+    steady_clock::time_point next{};
+    vector<uint8_t> ejected;            // per member
+    vector<uint32_t> ejections;         // per member, drives the ejection time
+    vector<steady_clock::time_point> until;
+    vector<uint32_t> changed;           // members ejected or returned by the last run
+    vector<uint32_t> pool;              // scratch: one pool's healthy primaries
+    vector<double> rtts;                // scratch: their known RTTs
+
+    void init(size_t members) {
+        ejected.assign(members, 0);
+        ejections.assign(members, 0);
+        until.assign(members, steady_clock::time_point{});
+        changed.reserve(members);
+        size_t largest = 0;
+        for (const auto& svc : services) largest = max(largest, svc.members.size());
+        pool.reserve(largest);
+        rtts.reserve(largest);
+    }
+
+    // avg: window loss % per server. Fills `changed`; false when it was not yet time.
+    bool run(steady_clock::time_point now, const int* avg, const JitterEstimator& jitter) {
+        changed.clear();
+        if (now < next) return false;
+        next = now + seconds(max(OUTLIER_INTERVAL_S, 1));
+
+        for (const Service& svc : services) {
+            pool.clear();
+            rtts.clear();
+            size_t primaries = 0, out = 0;
+            double sum = 0, sum_sq = 0;
+            for (uint32_t m : svc.members) {
+                if (member_role[m] != ROLE_PRIMARY) continue;
+                primaries++;
+                out += ejected[m];
+                if (member_health[m] != STATE_UP) {
+                    if (ejected[m] && now >= until[m]) restore(svc, m, &out);   // stays out on its health
+                    continue;
+                }
+                pool.push_back(m);
+                const double sr = 100 - avg[member_server[m]];
+                sum += sr;
+                sum_sq += sr * sr;
+                const double rtt = jitter.mean_ms(member_server[m]);
+                if (!isinf(rtt)) rtts.push_back(rtt);
+            }
+
+            const bool compare = pool.size() >= size_t(max(OUTLIER_MIN_HOSTS, 1));
+            const double mean = compare ? sum / pool.size() : 0;
+            const double stdev = compare ? sqrt(max(sum_sq / pool.size() - mean * mean, 0.0)) : 0;
+            double median = HUGE_VAL;
+            if (compare && OUTLIER_LATENCY_FACTOR > 0 && !rtts.empty()) {
+                nth_element(rtts.begin(), rtts.begin() + rtts.size() / 2, rtts.end());
+                median = rtts[rtts.size() / 2];
+            }
+            const size_t cap = max<size_t>(1, primaries * size_t(max(OUTLIER_MAX_EJECTION_PERCENT, 0)) / 100);
+
+            for (uint32_t m : pool) {
+                if (ejected[m] && now < until[m]) continue;
+                const size_t i = member_server[m];
+                const double sr = 100 - avg[i];
+                const double rtt = jitter.mean_ms(i);
+                const bool slow = !isinf(median) && !isinf(rtt) && rtt > OUTLIER_LATENCY_FACTOR * median &&
+                                  rtt - median > OUTLIER_MIN_LATENCY_MS;
+                const bool failing = compare && sr < mean - OUTLIER_STDEV_FACTOR * stdev &&
+                                     mean - sr > OUTLIER_MIN_SUCCESS_GAP;
+                if (!slow && !failing) {
+                    if (ejected[m]) restore(svc, m, &out);
+                    else if (ejections[m] > 0) ejections[m]--;
+                    continue;
+                }
+                // An expired ejection that is still an outlier is renewed for longer
+                if (!ejected[m] && out >= cap) continue;
+                ejections[m]++;
+                const int secs = min(OUTLIER_BASE_EJECTION_S * int(ejections[m]), OUTLIER_MAX_EJECTION_S);
+                until[m] = now + seconds(secs);
+                char why[160];
+                int len = 0;
+                if (failing)
+                    len = snprintf(why, sizeof(why), "success %.1f%% vs pool %.1f%% +/- %.1f", sr, mean, stdev);
+                if (slow)
+                    snprintf(why + len, sizeof(why) - len, "%srtt %.3fms vs pool median %.3fms", failing ? ", " : "",
+                             rtt, median);
+                cout << "[WARN] " << svc.name << ": " << (ejected[m] ? "keeping " : "ejecting ") << servers[i]
+                     << " out for " << secs << "s (" << why << ")" << endl;
+                if (!ejected[m]) {
+                    ejected[m] = 1;
+                    out++;
+                    changed.push_back(m);
+                }
+            }
+        }
+        return true;
+    }
+
+    void restore(const Service& svc, uint32_t m, size_t* out) {
+        ejected[m] = 0;
+        (*out)--;
+        changed.push_back(m);
+        cout << "[INFO] " << svc.name << ": " << servers[member_server[m]] << " returns from ejection" << endl;
+    }
+};
+
+// ---------------------------------------------------------
+// SHADOW POLICY
+// A second verdict per server, computed every tick from the same samples and
+// window store as the live one and never applied. "mean" runs the decision
+// kernel on the newest SHADOW_WINDOW_SECONDS of the live window; "ewma"
+// feeds it an exponentially weighted loss in hundredths of a percent. Only
+// the start and end of each disagreement with the live window verdict are
+// written, to stdout and STATE_DIR/shadow.log.
+struct ShadowPolicy {
+    size_t servers = 0;
+    size_t window = 0;
+    bool ewma = false;
+    vector<uint32_t> loss_sum;
+    vector<double> ewma_loss;           // %
+    vector<int> avg;
+    vector<uint8_t> state;
+    vector<uint64_t> changed;
+    vector<uint8_t> disagree;
+    vector<steady_clock::time_point> since;
+    FILE* log = nullptr;
+    uint64_t disagreements = 0;
+
+    void init(size_t n, const string& path) {
+        servers = n;
+        ewma = SHADOW_ESTIMATOR == "ewma";
+        window = size_t(max(1, min(SHADOW_WINDOW_SECONDS, WINDOW_SECONDS)));
+        loss_sum.assign(n, 0);
+        ewma_loss.assign(n, 0.0);
+        avg.assign(n, 0);
+        state.assign(n, STATE_UNKNOWN);
+        changed.assign((n + 63) / 64, 0);
+        disagree.assign(n, 0);
+        since.assign(n, steady_clock::time_point{});
+        log = path.empty() ? nullptr : fopen(path.c_str(), "a");   // empty: stdout only
+        if (!path.empty() && !log) cout << "[WARN] Cannot open " << path << ": " << strerror(errno) << endl;
+        cout << "[INFO] Shadow policy: " << (ewma ? "ewma" : "mean") << ", threshold " << SHADOW_THRESHOLD << "%";
+        if (ewma) cout << ", alpha " << SHADOW_EWMA_ALPHA << endl;
+        else cout << ", window " << window << "s" << endl;
+    }
+
+    // Returns the number of disagreements that started or ended
+    size_t update(DecideFn decide, const int* window_loss, uint32_t samples, const uint8_t* live, const int* live_avg) {
+        size_t events = 0;
+        if (ewma) {
+            for (size_t i = 0; i < servers; i++) {
+                ewma_loss[i] += SHADOW_EWMA_ALPHA * (window_loss[i] - ewma_loss[i]);
+                loss_sum[i] = uint32_t(ewma_loss[i] * 100 + 0.5);
+            }
+            decide(loss_sum.data(), servers, 100, SHADOW_THRESHOLD, avg.data(), state.data(), changed.data());
+        } else {
+            if (PACKED_LOSS_WINDOWS) packed_windows.recent_sums(window, loss_sum.data());
+            else loss_ring.recent_sums(window, loss_sum.data());
+            decide(loss_sum.data(), servers, min<uint32_t>(samples, uint32_t(window)), SHADOW_THRESHOLD, avg.data(),
+                   state.data(), changed.data());
+        }
+
+        for (size_t i = 0; i < servers; i++) {
+            const uint8_t now = state[i] != live[i];
+            if (now == disagree[i]) continue;
+            disagree[i] = now;
+            events++;
+            if (now) {
+                disagreements++;
+                since[i] = steady_clock::now();
+                write(i, "disagrees: live " + string(state_name(live[i])) + " (" + to_string(live_avg[i]) +
+                             "%), shadow " + state_name(state[i]) + " (" + to_string(avg[i]) + "%)");
+            } else {
+                auto secs = duration_cast<seconds>(steady_clock::now() - since[i]).count();
+                write(i, "agrees again after " + to_string(secs) + "s, both " + state_name(live[i]));
+            }
+        }
+        return events;
+    }
+
+    void write(size_t i, const string& what) {
+        cout << "[SHADOW] " << ::servers[i] << " " << what << endl;
+        if (!log) return;
+        char when[32];
+        time_t now = time(nullptr);
+        tm t;
+        localtime_r(&now, &t);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+        fprintf(log, "%s %s %s\n", when, ::servers[i].c_str(), what.c_str());
+        fflush(log);
+    }
+};
+
+ShadowPolicy shadow;
+
+// ---------------------------------------------------------
+// TRANSITION JOURNAL
+// Every add/remove is appended to STATE_DIR/journal.dat as a fixed-size
+// binary record holding the reason: window contents, threshold, failed
+// checks. Records are written in time order (the clock is clamped so it never
+// goes backwards), so the file is sorted by time. STATE_DIR/journal.idx has one
+// entry per JOURNAL_BLOCK records with the block's time range and a 256-bit
+// filter of the backends in it. `lvs_monitor journal` mmaps both files,
+// binary-searches the index and only reads blocks that can hold the backend.
+enum JournalReason : uint8_t { REASON_WINDOW = 1, REASON_HEALTH = 2, REASON_FAILOVER = 3, REASON_OUTLIER = 4 };
+
+struct JournalHeader {
+    char magic[8];              // "LVSJRNL" / "LVSJIDX"
+    uint32_t version;
+    uint32_t entry_size;        // sizeof(JournalRecord) / sizeof(JournalIndexEntry)
+    uint8_t reserved[48];
+};
+
+struct JournalRecord {
+    uint64_t time_ms;           // wall clock, ms since the epoch
+    uint32_t addr;              // backend IPv4, network order
+    uint8_t from, to;           // ServerState
+    uint8_t reason;             // JournalReason
+    uint8_t latest;             // last ICMP sample, %
+    uint32_t loss_sum;          // window loss sum (lost samples * 100)
+    uint32_t samples;           // samples in the window
+    uint32_t threshold;         // LOSS_THRESHOLD at the time
+    uint32_t failed_checks;     // bit c set: CHECKS[c] failed this tick
+    int32_t rtt_us;             // last echo RTT, -1 = lost
+    uint32_t reserved;
+    uint64_t window;            // newest 64 window samples, bit 0 = newest, 1 = lost
+    char service[32];
+    char detail[48];            // failed check names, comma separated, truncated
+};
+static_assert(sizeof(JournalRecord) == 128, "journal record layout");
+
+struct JournalIndexEntry {
+    uint64_t first_ms, last_ms;
+    uint64_t filter[4];         // bit (hash(addr) % 256) per record in the block
+};
+
+const uint32_t JOURNAL_VERSION = 1;
+const uint64_t JOURNAL_BLOCK = 256;
+
+uint64_t journal_filter_bit(uint32_t addr) {
+    return (uint64_t(addr) * 0x9E3779B97F4A7C15ull) >> 56;
+}
+
+bool mkdir_p(const string& dir) {
+    for (size_t at = 1; at <= dir.size(); at++) {
+        if (at != dir.size() && dir[at] != '/') continue;
+        if (mkdir(dir.substr(0, at).c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+// Opens fd and checks (or, for an empty file, writes) its header
+bool journal_header(int fd, const char* magic, uint32_t entry_size) {
+    JournalHeader h;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return false;
+    if (st.st_size == 0) {
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, magic, 8);
+        h.version = JOURNAL_VERSION;
+        h.entry_size = entry_size;
+        return pwrite(fd, &h, sizeof(h), 0) == ssize_t(sizeof(h));
+    }
+    return pread(fd, &h, sizeof(h), 0) == ssize_t(sizeof(h)) && memcmp(h.magic, magic, 8) == 0 &&
+           h.version == JOURNAL_VERSION && h.entry_size == entry_size;
+}
+
+struct Journal {
+    int data_fd = -1, index_fd = -1;
+    uint64_t records = 0;
+    uint64_t last_ms = 0;
+    JournalIndexEntry block{};      // entry of the block being filled
+    bool failed = false;
+
+    bool open_files(const string& dir) {
+        if (!mkdir_p(dir)) return false;
+        data_fd = open((dir + "/journal.dat").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        index_fd = open((dir + "/journal.idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (data_fd < 0 || index_fd < 0) return false;
+        if (!journal_header(data_fd, "LVSJRNL", sizeof(JournalRecord)) ||
+            !journal_header(index_fd, "LVSJIDX", sizeof(JournalIndexEntry))) {
+            errno = EINVAL;
+            return false;
+        }
+
+        // Drop a torn record left by a crash, then rebuild the index if it lags
+        struct stat st;
+        fstat(data_fd, &st);
+        records = (st.st_size - sizeof(JournalHeader)) / sizeof(JournalRecord);
+        if (ftruncate(data_fd, sizeof(JournalHeader) + records * sizeof(JournalRecord)) != 0) return false;
+        fstat(index_fd, &st);
+        uint64_t entries = (st.st_size - sizeof(JournalHeader)) / sizeof(JournalIndexEntry);
+        uint64_t want = (records + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK;
+        if (entries != want && !rebuild_index(want)) return false;
+
+        if (records > 0) {
+            JournalRecord r;
+            off_t at = sizeof(JournalHeader) + (records - 1) * sizeof(JournalRecord);
+            if (pread(data_fd, &r, sizeof(r), at) != ssize_t(sizeof(r))) return false;
+            last_ms = r.time_ms;
+            at = sizeof(JournalHeader) + (want - 1) * sizeof(JournalIndexEntry);
+            if (pread(index_fd, &block, sizeof(block), at) != ssize_t(sizeof(block))) return false;
+        }
+        return true;
+    }
+
+    bool open_dir(const string& dir) {
+        if (open_files(dir)) return true;
+        int saved = errno;
+        if (data_fd >= 0) close(data_fd);
+        if (index_fd >= 0) close(index_fd);
+        data_fd = index_fd = -1;
+        errno = saved;
+        return false;
+    }
+
+    bool rebuild_index(uint64_t entries) {
+        if (ftruncate(index_fd, sizeof(JournalHeader)) != 0) return false;
+        JournalRecord r;
+        for (uint64_t e = 0; e < entries; e++) {
+            JournalIndexEntry entry{};
+            for (uint64_t k = e * JOURNAL_BLOCK; k < min(records, (e + 1) * JOURNAL_BLOCK); k++) {
+                if (pread(data_fd, &r, sizeof(r), sizeof(JournalHeader) + k * sizeof(r)) != ssize_t(sizeof(r)))
+                    return false;
+                if (k == e * JOURNAL_BLOCK) entry.first_ms = r.time_ms;
+                entry.last_ms = r.time_ms;
+                uint64_t bit = journal_filter_bit(r.addr);
+                entry.filter[bit / 64] |= uint64_t(1) << (bit % 64);
+            }
+            off_t at = sizeof(JournalHeader) + e * sizeof(entry);
+            if (pwrite(index_fd, &entry, sizeof(entry), at) != ssize_t(sizeof(entry))) return false;
+        }
+        return true;
+    }
+
+    void append(JournalRecord& r) {
+        if (data_fd < 0 || failed) return;
+        uint64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+        r.time_ms = last_ms = max(now, last_ms);
+
+        if (records % JOURNAL_BLOCK == 0) block = JournalIndexEntry{r.time_ms, r.time_ms, {}};
+        block.last_ms = r.time_ms;
+        uint64_t bit = journal_filter_bit(r.addr);
+        block.filter[bit / 64] |= uint64_t(1) << (bit % 64);
+
+        off_t rec_at = sizeof(JournalHeader) + records * sizeof(r);
+        off_t idx_at = sizeof(JournalHeader) + (records / JOURNAL_BLOCK) * sizeof(block);
+        if (pwrite(data_fd, &r, sizeof(r), rec_at) != ssize_t(sizeof(r)) ||
+            pwrite(index_fd, &block, sizeof(block), idx_at) != ssize_t(sizeof(block))) {
+            cout << "[WARN] Transition journal write failed (" << strerror(errno) << "), journal disabled" << endl;
+            failed = true;
+            return;
+        }
+        records++;
+    }
+};
+
+Journal journal;
+
+// ---------------------------------------------------------
+// HEALTH HISTORY: round-robin archives, one fixed-size file per backend in
+// STATE_DIR/rra/<ip>.rra, or <ip>@<probe path>.rra off the default path (with
+// ',' for '/', e.g. 10.1.2.2@blue,eth1.rra), mapped shared into memory. Each archive is a ring of
+// rows at one resolution (RRA_SPECS). A sample updates the accumulator of the
+// current step in the file header and rewrites that step's row, so an update
+// is O(1) per archive and a restart resumes where the file left off. Steps
+// skipped while the monitor was down are cleared (at most one ring's worth).
+struct RraSpec {
+    uint32_t step_s;
+    uint32_t rows;
+};
+const RraSpec RRA_SPECS[] = {{1, 3600}, {60, 7 * 24 * 60}, {3600, 365 * 24}};  // 1h, 1 week, 1 year
+const uint32_t RRA_ARCHIVES = sizeof(RRA_SPECS) / sizeof(RRA_SPECS[0]);
+const uint32_t RRA_VERSION = 1;
+
+struct RraArchive {
+    uint32_t step_s, rows;
+    uint64_t offset;                // file offset of row 0
+    uint64_t cur_step;              // step the accumulator belongs to (time / step_s), 0 = none yet
+    uint32_t samples, lost, replies, rtt_max_us;
+    uint64_t rtt_sum_us;
+};
+
+struct RraHeader {
+    char magic[8];                  // "LVSRRA"
+    uint32_t version;
+    uint32_t archives;
+    RraArchive arch[RRA_ARCHIVES];
+};
+
+struct RraRow {
+    float loss;                     // % of samples lost; samples == 0 means no data
+    float rtt_avg_ms, rtt_max_ms;   // over samples with an RTT
+    uint16_t samples, replies;
+};
+
+size_t rra_file_size() {
+    size_t size = (sizeof(RraHeader) + 63) & ~size_t(63);
+    for (const auto& spec : RRA_SPECS) size += size_t(spec.rows) * sizeof(RraRow);
+    return size;
+}
+
+bool rra_header_ok(const RraHeader* h) {
+    if (memcmp(h->magic, "LVSRRA", 7) != 0 || h->version != RRA_VERSION || h->archives != RRA_ARCHIVES) return false;
+    for (uint32_t a = 0; a < RRA_ARCHIVES; a++)
+        if (h->arch[a].step_s != RRA_SPECS[a].step_s || h->arch[a].rows != RRA_SPECS[a].rows) return false;
+    return true;
+}
+
+// The same address on two probe paths is two backends with two files
+string rra_file_name(const string& ip, string path) {
+    replace(path.begin(), path.end(), '/', ',');
+    return ip + (path.empty() ? "" : "@" + path) + ".rra";
+}
+
+struct RraStore {
+    vector<uint8_t*> maps;          // per server, null if its file could not be opened
+
+    bool init(const string& dir, const vector<string>& server_ips, const vector<uint32_t>& path_of) {
+        if (!mkdir_p(dir)) return false;
+        const size_t size = rra_file_size();
+        maps.assign(server_ips.size(), nullptr);
+        for (size_t i = 0; i < server_ips.size(); i++) {
+            string path = dir + "/" + rra_file_name(server_ips[i], probe_path_name(path_of[i]));
+            int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) != 0) {
+                cout << "[WARN] Cannot open " << path << ": " << strerror(errno) << endl;
+                if (fd >= 0) close(fd);
+                continue;
+            }
+            const bool fresh = size_t(st.st_size) != size;
+            if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+                cout << "[WARN] Cannot size " << path << ": " << strerror(errno) << endl;
+                close(fd);
+                continue;
+            }
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) {
+                cout << "[WARN] Cannot map " << path << ": " << strerror(errno) << endl;
+                continue;
+            }
+            auto* h = (RraHeader*)p;
+            if (fresh || !rra_header_ok(h)) {
+                if (!fresh) cout << "[WARN] " << path << " has a different layout, starting it over" << endl;
+                memset(p, 0, size);
+                memcpy(h->magic, "LVSRRA", 7);
+                h->version = RRA_VERSION;
+                h->archives = RRA_ARCHIVES;
+                uint64_t offset = (sizeof(RraHeader) + 63) & ~uint64_t(63);
+                for (uint32_t a = 0; a < RRA_ARCHIVES; a++) {
+                    h->arch[a].step_s = RRA_SPECS[a].step_s;
+                    h->arch[a].rows = RRA_SPECS[a].rows;
+                    h->arch[a].offset = offset;
+                    offset += uint64_t(RRA_SPECS[a].rows) * sizeof(RraRow);
+                }
+            }
+            maps[i] = (uint8_t*)p;
+        }
+        return true;
+    }
+
+    // One sample per server: lost if latest > 0, rtt_us may be null or -1
+    void update(uint64_t now_s, const int* latest, const int* rtt_us) {
+        for (size_t i = 0; i < maps.size(); i++) {
+            if (!maps[i]) continue;
+            auto* h = (RraHeader*)maps[i];
+            const int rtt = rtt_us ? rtt_us[i] : -1;
+            for (uint32_t a = 0; a < RRA_ARCHIVES; a++) {
+                RraArchive& ar = h->arch[a];
+                auto* rows = (RraRow*)(maps[i] + ar.offset);
+                const uint64_t step = now_s / ar.step_s;
+                if (step < ar.cur_step) continue;           // clock went backwards
+                if (step != ar.cur_step) {
+                    if (ar.cur_step != 0) {
+                        uint64_t gap = min<uint64_t>(step - ar.cur_step - 1, ar.rows);
+                        for (uint64_t s = step - gap; s < step; s++) rows[s % ar.rows] = RraRow{};
+                    }
+                    ar.cur_step = step;
+                    ar.samples = ar.lost = ar.replies = ar.rtt_max_us = 0;
+                    ar.rtt_sum_us = 0;
+                }
+                ar.samples++;
+                ar.lost += latest[i] > 0;
+                if (rtt >= 0) {
+                    ar.replies++;
+                    ar.rtt_sum_us += rtt;
+                    ar.rtt_max_us = max(ar.rtt_max_us, uint32_t(rtt));
+                }
+                RraRow& row = rows[step % ar.rows];
+                row.samples = uint16_t(min<uint32_t>(ar.samples, UINT16_MAX));
+                row.replies = uint16_t(min<uint32_t>(ar.replies, UINT16_MAX));
+                row.loss = 100.0f * ar.lost / ar.samples;
+                row.rtt_avg_ms = ar.replies ? float(ar.rtt_sum_us / 1000.0 / ar.replies) : 0.0f;
+                row.rtt_max_ms = ar.rtt_max_us / 1000.0f;
+            }
+        }
+    }
+};
+
+RraStore history;
+
+// ---------------------------------------------------------
+// IPVS APPLY
+// Every (member, protocol, port) is one destination in the kernel table with
+// a desired state (its member's state) and an applied state (what the last
+// successful ipvsadm call left). Each ipvsadm result is checked.
+struct ApplyResult {
+    bool ok;
+    string error;               // ipvsadm's message when !ok
+};
+
+// Runs cmd with stderr captured; `benign` is an error that already means success
+ApplyResult run_ipvsadm(const string& cmd, const char* benign = nullptr) {
+    FILE* pipe = popen((cmd + " 2>&1").c_str(), "r");
+    if (!pipe) return {false, strerror(errno)};
+
+    char output[512];
+    size_t len = 0;
+    while (len < sizeof(output) - 1 && fgets(output + len, sizeof(output) - len, pipe))
+        len += strlen(output + len);
+    output[len] = '\0';
+    char discard[256];
+    while (fgets(discard, sizeof(discard), pipe)) {}
+
+    int status = pclose(pipe);
+    while (len > 0 && (output[len - 1] == '\n' || output[len - 1] == ' ')) output[--len] = '\0';
+    if (status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) return {true, ""};
+    if (benign && strstr(output, benign)) return {true, ""};
+    if (len == 0) snprintf(output, sizeof(output), "exit status %d", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return {false, output};
+}
+
+// Feeds `lines` to a single `ipvsadm -R` (restore without clearing). The
+// batch is passed through an in-memory file, so the child never blocks on
+// its stdin while the monitor waits for its output.
+ApplyResult run_ipvsadm_batch(const string& lines) {
+    int in = memfd_create("lvs_apply", MFD_CLOEXEC);
+    if (in < 0) return {false, strerror(errno)};
+    int out[2] = {-1, -1};
+    if (write(in, lines.data(), lines.size()) != ssize_t(lines.size()) || lseek(in, 0, SEEK_SET) != 0 ||
+        pipe2(out, O_CLOEXEC) != 0) {
+        int saved = errno;
+        close(in);
+        return {false, strerror(saved)};
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in, 0);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, out[1], 2);
+    char* argv[] = {(char*)"ipvsadm", (char*)"-R", nullptr};
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, nullptr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in);
+    close(out[1]);
+    if (rc != 0) {
+        close(out[0]);
+        return {false, strerror(rc)};
+    }
+
+    char output[512];
+    size_t len = 0;
+    for (;;) {
+        char buf[256];
+        ssize_t got = read(out[0], buf, sizeof(buf));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        size_t take = min(size_t(got), sizeof(output) - 1 - len);
+        memcpy(output + len, buf, take);
+        len += take;
+    }
+    close(out[0]);
+    output[len] = '\0';
+    while (len > 0 && (output[len - 1] == '\n' || output[len - 1] == ' ')) output[--len] = '\0';
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && len == 0) return {true, ""};
+    if (len == 0) snprintf(output, sizeof(output), "exit status %d", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    return {false, output};
+}
+
+// created_services key of a virtual service, e.g. "TCP:10.0.0.1:80" or "blue/TCP:10.0.0.1:80"
+string service_key(uint32_t ns, char type, const string& vip_port) {
+    return (ns ? netns.names[ns] + "/" : string()) + (type == 't' ? "TCP:" : "UDP:") + vip_port;
+}
+
+// Adds every virtual service in namespace ns's kernel table to
+// created_services with one `ipvsadm -Sn`; with `dests`, also collects its
+// destinations as "t vip:port ip:port"
+bool load_existing_services(uint32_t ns, set<string>* dests = nullptr) {
+    NetnsScope in(ns);
+    if (!in.ok) return false;
+    FILE* pipe = popen("ipvsadm -Sn 2>/dev/null", "r");
+    if (!pipe) return false;
+    char line[256], vip[128], real[128];
+    char type;
+    int port;
+    while (fgets(line, sizeof(line), pipe)) {
+        if (sscanf(line, "-A -%c %127[^:]:%d", &type, vip, &port) == 3 && (type == 't' || type == 'u'))
+            created_services.insert(service_key(ns, type, string(vip) + ":" + to_string(port)));
+        else if (dests && sscanf(line, "-a -%c %127s -r %127s", &type, vip, real) == 3)
+            dests->insert(string(1, type) + " " + vip + " " + real);
+    }
+    return pclose(pipe) == 0;
+}
+
+// Runs in the caller's namespace; adds the ipvsadm calls it made to *calls
+ApplyResult create_service_if_needed(uint32_t ns, const string& vip, char type, int port, uint64_t* calls) {
+    string proto = (type == 't') ? "TCP" : "UDP";
+    string key = service_key(ns, type, vip + ":" + to_string(port));
+
+    if (created_services.count(key)) return {true, ""};
+
+    string check_cmd =
+        "ipvsadm -Ln | grep -q \"^" + proto + " " + vip + ":" + to_string(port) + "\"";
+
+    (*calls)++;
+    if (system(check_cmd.c_str()) != 0) {
+        (*calls)++;
+        string cmd_add =
+            "ipvsadm -A -" + string(1, type) + " " +
+            vip + ":" + to_string(port) + " -s rr";
+
+        ApplyResult r = run_ipvsadm(cmd_add, "already exists");
+        if (!r.ok) return r;
+        cout << "[INFO] Created " << proto << " " << vip << ":" << port << endl;
+    }
+    created_services.insert(key);
+    return {true, ""};
+}
+
+enum ApplyOp : uint8_t { OP_ADD = 0, OP_REMOVE = 1 };
+
+// A member's transition is one transaction over all of its destinations.
+// Adding commits only when every destination is in the table: on the first
+// failure the destinations already added are deleted again, so a backend is
+// never in some ports of a service and not others. Removal goes forward
+// only, since putting a dead backend back on the ports it already left is
+// worse than leaving it half out; whatever fails stays marked and is
+// reconciled by the member's next attempt. Failed transactions are retried
+// as a whole with exponential backoff.
+//
+// Transactions wait in one pending queue and run under a budget: a token
+// bucket of APPLY_MAX_OPS_PER_SEC ipvsadm operations, destinations and the
+// lookups and -A that create their services alike, and at most
+// APPLY_MAX_REMOVALS removals per APPLY_REMOVAL_INTERVAL_S across all services. When a mass event
+// exceeds it, adds go first (they restore capacity), then removals by window
+// loss, worst first; the rest wait for the next tick.
+//
+// Decisions are made once per tick, so the tick is the coalescing window:
+// every transaction admitted in it goes to the kernel as one `ipvsadm -R`
+// batch. Only destinations whose applied state differs from the desired one
+// are written, so a remove and an add of the same destination that cancel
+// out never reach the kernel. If the batch fails, the same transactions are
+// run one operation at a time, which finds the failing step and rolls back.
+//
+// Applied states start from one dump of the live table, so after a restart
+// the first batch does not add what is already there. With DRY_RUN the
+// batch is recorded instead of run: printed as [PLAN] lines and appended
+// in `ipvsadm -R` format to STATE_DIR/plan.ipvsadm. Everything up to the
+// kernel call is the same code, so the time a plan takes is what applying
+// would cost without the ipvsadm process.
+//
+// Every ipvsadm process is started inside the namespace of the service it
+// changes; a tick's batch is split into one per namespace.
+struct Applier {
+    // Per destination, in member order: member m owns [member_dests[m], member_dests[m + 1])
+    vector<uint32_t> member_dests;
+    vector<uint32_t> dest_member;
+    vector<uint16_t> dest_port;
+    vector<char> dest_type;             // 't' or 'u'
+    vector<uint8_t> applied;            // STATE_UP = in the table, STATE_DOWN = not, STATE_UNKNOWN = never applied
+
+    // Per member
+    vector<uint32_t> attempts;          // consecutive failed transactions
+    vector<steady_clock::time_point> next_try;
+    vector<uint32_t> priority;          // adds above every removal, removals by window loss
+    vector<uint8_t> queued;
+    vector<uint32_t> pending;           // members not yet at their desired state, capacity reserved up front
+    vector<uint32_t> batch;             // members admitted this tick
+    vector<uint32_t> added;             // destinations the running add transaction put in the table
+    string batch_text;                  // ipvsadm -R input, capacity reused
+
+    double tokens = 0;                  // ipvsadm calls the budget allows right now
+    steady_clock::time_point refilled{};
+    vector<steady_clock::time_point> removal_times;   // ring of the last APPLY_MAX_REMOVALS removals, all services
+    size_t removal_next = 0;
+    uint64_t service_ops = 0;           // ipvsadm calls made to find or create virtual services
+    bool deferring = false;
+
+    uint64_t ops[2] = {}, failures[2] = {}, retries = 0, rollbacks = 0, batches = 0, batch_failures = 0;
+    FILE* plan = nullptr;               // DRY_RUN: where batches are recorded
+    uint64_t deferred_ops = 0, deferred_removals = 0;
+    bool metrics_dirty = true;
+
+    void init() {
+        const size_t members = member_service.size();
+        member_dests.assign(members + 1, 0);
+        for (size_t m = 0; m < members; m++) {
+            const Service& svc = services[member_service[m]];
+            for (int port : svc.tcp_ports) add_dest(m, 't', port);
+            for (int port : svc.udp_ports) add_dest(m, 'u', port);
+            member_dests[m + 1] = uint32_t(dest_member.size());
+        }
+        applied.assign(dest_member.size(), STATE_UNKNOWN);
+        attempts.assign(members, 0);
+        next_try.assign(members, steady_clock::time_point{});
+        priority.assign(members, 0);
+        queued.assign(members, 0);
+        pending.reserve(members);
+        batch.reserve(members);
+        uint32_t widest = 0;
+        for (size_t m = 0; m < members; m++) widest = max(widest, member_dests[m + 1] - member_dests[m]);
+        added.reserve(widest);
+        tokens = APPLY_MAX_OPS_PER_SEC;
+        refilled = steady_clock::now();
+        removal_times.assign(max(APPLY_MAX_REMOVALS, 0), steady_clock::time_point{});
+    }
+
+    // Applied state from one `ipvsadm -Sn` per namespace; left unknown if any fails
+    bool load_applied(size_t* dests) {
+        vector<set<string>> live(netns.size());
+        *dests = 0;
+        for (uint32_t ns = 0; ns < netns.size(); ns++) {
+            if (!load_existing_services(ns, &live[ns])) return false;
+            *dests += live[ns].size();
+        }
+        for (size_t d = 0; d < dest_member.size(); d++) {
+            const uint32_t m = dest_member[d];
+            const Service& svc = services[member_service[m]];
+            const string port = to_string(dest_port[d]);
+            const string key = string(1, dest_type[d]) + " " + svc.vip + ":" + port + " " +
+                               servers[member_server[m]] + ":" + port;
+            applied[d] = live[svc.netns].count(key) ? STATE_UP : STATE_DOWN;
+        }
+        return true;
+    }
+
+    bool start_plan(const string& path) {
+        size_t dests = 0;
+        if (!load_applied(&dests)) return false;
+        plan = fopen(path.c_str(), "a");
+        if (!plan) return false;
+        cout << "[PLAN] Dry run against " << dests << " live destinations, recording to " << path << endl;
+        return true;
+    }
+
+    void record_plan(uint32_t ns, size_t lines, int64_t plan_us) {
+        char when[32];
+        time_t now = time(nullptr);
+        tm t;
+        localtime_r(&now, &t);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+        fprintf(plan, "# %s, %zu operations%s%s\n%s", when, lines, ns ? ", netns " : "", netns.names[ns].c_str(),
+                batch_text.c_str());
+        fflush(plan);
+        for (size_t at = 0, end; at < batch_text.size(); at = end + 1) {
+            end = batch_text.find('\n', at);
+            cout << "[PLAN] ipvsadm " << batch_text.substr(at, end - at) << "\n";
+        }
+        cout << "[PLAN] " << lines << " operations, planned in " << plan_us << "us" << endl;
+    }
+
+    void add_dest(size_t m, char type, int port) {
+        dest_member.push_back(uint32_t(m));
+        dest_type.push_back(type);
+        dest_port.push_back(uint16_t(port));
+    }
+
+    size_t out_of_sync(size_t m) const {
+        size_t count = 0;
+        for (uint32_t d = member_dests[m]; d < member_dests[m + 1]; d++) count += applied[d] != member_state[m];
+        return count;
+    }
+
+    // One ipvsadm call moving destination d to `to`
+    bool apply(uint32_t d, uint8_t to) {
+        const uint32_t m = dest_member[d];
+        const Service& svc = services[member_service[m]];
+        const string& ip = servers[member_server[m]];
+        const string port = to_string(dest_port[d]);
+        const ApplyOp op = to == STATE_UP ? OP_ADD : OP_REMOVE;
+
+        NetnsScope in(svc.netns);
+        ApplyResult r{in.ok, in.ok ? "" : "cannot enter network namespace " + netns.names[svc.netns]};
+        if (r.ok && op == OP_ADD) r = create_service_if_needed(svc.netns, svc.vip, dest_type[d], dest_port[d], &service_ops);
+        string cmd = string(op == OP_ADD ? "ipvsadm -a -" : "ipvsadm -d -") + dest_type[d] + " " +
+                     svc.vip + ":" + port + " -r " + ip + ":" + port + (op == OP_ADD ? " -m" : "");
+        if (r.ok) {
+            // Adding what is there or deleting what is gone leaves the table as wanted
+            r = run_ipvsadm(cmd, op == OP_ADD ? "already exists" : "No such");
+            if (!r.ok && op == OP_REMOVE && strstr(r.error.c_str(), "Service not defined")) r = {true, ""};
+        }
+        ops[op]++;
+        metrics_dirty = true;
+
+        if (r.ok) {
+            applied[d] = to;
+            return true;
+        }
+        failures[op]++;
+        cout << "[ERROR] " << cmd << ": " << r.error << endl;
+        return false;
+    }
+
+    // Brings member m to member_state[m]; false if it is not there yet
+    bool run_transaction(uint32_t m) {
+        const uint8_t want = member_state[m];
+        size_t failed = 0;
+        added.clear();
+        for (uint32_t d = member_dests[m]; d < member_dests[m + 1] && !(failed && want == STATE_UP); d++) {
+            if (applied[d] == want) continue;
+            if (!apply(d, want)) failed++;
+            else if (want == STATE_UP) added.push_back(d);
+        }
+        if (failed == 0) return true;
+
+        if (want == STATE_UP) {
+            // Only what this transaction added; destinations never attempted stay as they are
+            rollbacks++;
+            size_t stuck = 0;
+            for (uint32_t d : added)
+                if (!apply(d, STATE_DOWN)) stuck++;
+            if (stuck)
+                cout << "[ERROR] Rollback left " << servers[member_server[m]] << " on " << stuck
+                     << " destinations of " << services[member_service[m]].name << ", reconciling" << endl;
+        }
+        return false;
+    }
+
+    void schedule_retry(uint32_t m) {
+        attempts[m]++;
+        int64_t backoff = APPLY_RETRY_MS;
+        for (uint32_t k = 1; k < attempts[m] && backoff < APPLY_RETRY_MAX_MS; k++) backoff *= 2;
+        backoff = min<int64_t>(backoff, APPLY_RETRY_MAX_MS);
+        next_try[m] = steady_clock::now() + milliseconds(backoff);
+        cout << "[WARN] " << (member_state[m] == STATE_UP ? "Adding " : "Removing ") << servers[member_server[m]]
+             << (member_state[m] == STATE_UP ? " to " : " from ") << services[member_service[m]].name
+             << " failed (attempt " << attempts[m] << "), retry in " << backoff << "ms" << endl;
+    }
+
+    void report(uint32_t m) {
+        const string& ip = servers[member_server[m]];
+        const string& name = services[member_service[m]].name;
+        const char* after = attempts[m] ? " after a retry" : "";
+        if (plan)
+            cout << "[PLAN] Would " << (member_state[m] == STATE_UP ? "add " : "remove ") << ip
+                 << (member_state[m] == STATE_UP ? " to " : " from ") << name << endl;
+        else if (member_state[m] == STATE_UP)
+            cout << "[INFO] Added " << ip << " back to " << name << after << endl;
+        else
+            cout << "[WARN] Removed " << ip << " from " << name << after << endl;
+        attempts[m] = 0;
+    }
+
+    // Called after member_state[m] changed; window_loss orders removals
+    void transition(uint32_t m, int window_loss) {
+        attempts[m] = 0;        // a new desired state starts its own backoff
+        next_try[m] = steady_clock::time_point{};
+        priority[m] = member_state[m] == STATE_UP ? 1000 : uint32_t(max(window_loss, 0));
+        if (!queued[m]) {
+            queued[m] = 1;
+            pending.push_back(m);
+        }
+    }
+
+    // The oldest of the last APPLY_MAX_REMOVALS removals is out of the interval
+    bool removal_allowed(steady_clock::time_point now) const {
+        return removal_times.empty() ||
+               now - removal_times[removal_next] >= seconds(APPLY_REMOVAL_INTERVAL_S) ||
+               removal_times[removal_next] == steady_clock::time_point{};
+    }
+
+    void count_removal(steady_clock::time_point now) {
+        if (removal_times.empty()) return;
+        removal_times[removal_next] = now;
+        removal_next = (removal_next + 1) % removal_times.size();
+    }
+
+    // Writes one batch line per destination of the admitted members in namespace ns that is out of sync
+    bool run_batch(uint32_t ns) {
+        const auto started = steady_clock::now();
+        batch_text.clear();
+        size_t lines = 0, service_lines = 0;
+        bool listed = false;
+        for (uint32_t m : batch) {
+            const Service& svc = services[member_service[m]];
+            if (svc.netns != ns) continue;
+            const string& ip = servers[member_server[m]];
+            const bool up = member_state[m] == STATE_UP;
+            for (uint32_t d = member_dests[m]; d < member_dests[m + 1]; d++) {
+                if (applied[d] == member_state[m]) continue;
+                const string port = to_string(dest_port[d]);
+                const string vip_port = svc.vip + ":" + port;
+                if (up) {
+                    const string key = service_key(ns, dest_type[d], vip_port);
+                    if (!created_services.count(key) && !listed && !plan) {
+                        load_existing_services(ns);
+                        listed = true;
+                        service_lines++;
+                    }
+                    if (!created_services.count(key)) {
+                        batch_text += string("-A -") + dest_type[d] + " " + vip_port + " -s rr\n";
+                        service_lines++;
+                        created_services.insert(key);
+                        if (!plan)
+                            cout << "[INFO] Created " << (dest_type[d] == 't' ? "TCP " : "UDP ") << vip_port << endl;
+                    }
+                }
+                batch_text += string(up ? "-a -" : "-d -") + dest_type[d] + " " + vip_port + " -r " + ip + ":" +
+                              port + (up ? " -m\n" : "\n");
+                lines++;
+            }
+        }
+        if (lines == 0) return true;
+
+        batches++;
+        metrics_dirty = true;
+        ApplyResult r{true, ""};
+        if (plan) {
+            record_plan(ns, lines, duration_cast<microseconds>(steady_clock::now() - started).count());
+        } else {
+            NetnsScope in(ns);
+            r = in.ok ? run_ipvsadm_batch(batch_text) : ApplyResult{false, "cannot enter network namespace"};
+        }
+        if (!r.ok) {
+            batch_failures++;
+            cout << "[WARN] ipvsadm batch of " << lines << " operations failed (" << r.error
+                 << "), applying them one by one" << endl;
+            created_services.clear();   // the -A lines may not have made it
+            return false;
+        }
+        service_ops += service_lines;
+        tokens -= double(service_lines);
+        for (uint32_t m : batch) {
+            if (services[member_service[m]].netns != ns) continue;
+            ops[member_state[m] == STATE_UP ? OP_ADD : OP_REMOVE] += out_of_sync(m);
+            for (uint32_t d = member_dests[m]; d < member_dests[m + 1]; d++) applied[d] = member_state[m];
+        }
+        return true;
+    }
+
+    // Runs due transactions, best first, while the budget lasts; returns how many ran
+    size_t run_pending(steady_clock::time_point now) {
+        if (pending.empty()) return 0;
+        if (APPLY_MAX_OPS_PER_SEC > 0) {
+            tokens = min<double>(APPLY_MAX_OPS_PER_SEC,
+                                 tokens + APPLY_MAX_OPS_PER_SEC * duration<double>(now - refilled).count());
+            refilled = now;
+        }
+        sort(pending.begin(), pending.end(), [this](uint32_t a, uint32_t b) {
+            return priority[a] != priority[b] ? priority[a] > priority[b] : a < b;
+        });
+
+        // Admit what the budget allows into this tick's batch
+        size_t waiting = 0;
+        batch.clear();
+        for (uint32_t m : pending) {
+            const size_t need = out_of_sync(m);
+            if (need == 0 || now < next_try[m]) continue;
+
+            // A transaction bigger than the whole bucket runs once the bucket is full
+            const double cost = min<double>(need, APPLY_MAX_OPS_PER_SEC);
+            const bool removal = member_state[m] != STATE_UP;
+            if (APPLY_MAX_OPS_PER_SEC > 0 && tokens < cost) {
+                deferred_ops++;
+                waiting++;
+                continue;
+            }
+            if (removal && !removal_allowed(now)) {
+                deferred_removals++;
+                waiting++;
+                continue;
+            }
+            tokens -= double(need);
+            if (removal) count_removal(now);
+            if (attempts[m]) retries++;
+            batch.push_back(m);
+        }
+
+        for (uint32_t ns = 0; ns < netns.size() && !batch.empty(); ns++) {
+            if (run_batch(ns)) continue;
+            for (uint32_t m : batch) {
+                if (services[member_service[m]].netns != ns) continue;
+                // Admission charged the batch lines; charge the calls actually run instead
+                tokens += double(out_of_sync(m));
+                const uint64_t calls_before = ops[OP_ADD] + ops[OP_REMOVE] + service_ops;
+                run_transaction(m);
+                tokens -= double(ops[OP_ADD] + ops[OP_REMOVE] + service_ops - calls_before);
+            }
+        }
+        for (uint32_t m : batch) {
+            if (out_of_sync(m) == 0) report(m);
+            else schedule_retry(m);
+        }
+
+        size_t keep = 0;
+        for (uint32_t m : pending) {
+            if (out_of_sync(m) == 0) {
+                queued[m] = 0;          // applied, or flipped back to what the table already holds
+                attempts[m] = 0;
+                continue;
+            }
+            pending[keep++] = m;
+        }
+        pending.resize(keep);
+
+        if (waiting && !deferring)
+            cout << "[WARN] Apply budget reached, " << waiting << " backend transitions waiting" << endl;
+        else if (!waiting && deferring)
+            cout << "[INFO] Apply budget caught up" << endl;
+        if (waiting || deferring) metrics_dirty = true;
+        deferring = waiting > 0;
+        return batch.size();
+    }
+
+    // node_exporter textfile format, rewritten only after ipvsadm calls
+    void write_metrics(const string& path) {
+        if (!metrics_dirty) return;
+        metrics_dirty = false;
+        string tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "w");
+        if (!f) return;
+        const char* names[2] = {"add", "remove"};
+        fprintf(f, "# HELP lvs_monitor_apply_ops_total ipvsadm destination operations run.\n"
+                   "# TYPE lvs_monitor_apply_ops_total counter\n");
+        for (int op = 0; op < 2; op++)
+            fprintf(f, "lvs_monitor_apply_ops_total{op=\"%s\"} %llu\n", names[op], (unsigned long long)ops[op]);
+        fprintf(f, "# HELP lvs_monitor_apply_failures_total ipvsadm destination operations that failed.\n"
+                   "# TYPE lvs_monitor_apply_failures_total counter\n");
+        for (int op = 0; op < 2; op++)
+            fprintf(f, "lvs_monitor_apply_failures_total{op=\"%s\"} %llu\n", names[op],
+                    (unsigned long long)failures[op]);
+        fprintf(f, "# HELP lvs_monitor_apply_batches_total ipvsadm -R batches run, one per tick with transitions.\n"
+                   "# TYPE lvs_monitor_apply_batches_total counter\n"
+                   "lvs_monitor_apply_batches_total %llu\n", (unsigned long long)batches);
+        fprintf(f, "# HELP lvs_monitor_apply_batch_failures_total Batches that failed and were applied one operation at a time.\n"
+                   "# TYPE lvs_monitor_apply_batch_failures_total counter\n"
+                   "lvs_monitor_apply_batch_failures_total %llu\n", (unsigned long long)batch_failures);
+        fprintf(f, "# HELP lvs_monitor_apply_retries_total Transactions run again after a failure.\n"
+                   "# TYPE lvs_monitor_apply_retries_total counter\n"
+                   "lvs_monitor_apply_retries_total %llu\n", (unsigned long long)retries);
+        fprintf(f, "# HELP lvs_monitor_apply_rollbacks_total Add transactions rolled back after a failed step.\n"
+                   "# TYPE lvs_monitor_apply_rollbacks_total counter\n"
+                   "lvs_monitor_apply_rollbacks_total %llu\n", (unsigned long long)rollbacks);
+        fprintf(f, "# HELP lvs_monitor_apply_deferred_total Times a due transaction waited for the apply budget.\n"
+                   "# TYPE lvs_monitor_apply_deferred_total counter\n"
+                   "lvs_monitor_apply_deferred_total{budget=\"ops\"} %llu\n"
+                   "lvs_monitor_apply_deferred_total{budget=\"removals\"} %llu\n",
+                (unsigned long long)deferred_ops, (unsigned long long)deferred_removals);
+        fprintf(f, "# HELP lvs_monitor_apply_pending Backends in a service not yet at their desired state.\n"
+                   "# TYPE lvs_monitor_apply_pending gauge\n"
+                   "lvs_monitor_apply_pending %zu\n", pending.size());
+        fprintf(f, "# HELP lvs_monitor_apply_budget_tokens ipvsadm calls the ops budget allows right now.\n"
+                   "# TYPE lvs_monitor_apply_budget_tokens gauge\n"
+                   "lvs_monitor_apply_budget_tokens %.0f\n", APPLY_MAX_OPS_PER_SEC > 0 ? max(tokens, 0.0) : -1.0);
+        fprintf(f, "# HELP lvs_monitor_destinations_out_of_sync Destinations whose applied state differs from the desired one.\n"
+                   "# TYPE lvs_monitor_destinations_out_of_sync gauge\n");
+        for (size_t m = 0; m < member_service.size(); m++)
+            fprintf(f, "lvs_monitor_destinations_out_of_sync{service=\"%s\",backend=\"%s\"} %zu\n",
+                    services[member_service[m]].name.c_str(), servers[member_server[m]].c_str(), out_of_sync(m));
+        if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+    }
+};
+
+Applier applier;
+
+// ---------------------------------------------------------
+// PASSIVE HEALTH
+// The kernel counts connections, packets and bytes per destination. Every
+// PASSIVE_INTERVAL_S one `ipvsadm -Ln --stats --exact` per namespace dumps
+// them for all services; each line is matched to its destination by binary
+// search over keys built at startup, and deltas and rates are taken from the
+// previous dump. A destination that got at least PASSIVE_MIN_CONNS new
+// connections but sent no bytes back is flagged silent for PASSIVE_HOLD_S: in
+// NAT mode, replies pass through the director, so this catches backends that
+// accept and then hang without any probe traffic. Parsing works in fixed
+// buffers, so a poll does not allocate.
+struct PassiveStats {
+    struct Key {
+        uint64_t service;               // netns << 56 | type << 48 | port << 32 | vip
+        uint64_t real;                  // port << 32 | rip
+        bool operator<(const Key& o) const { return service != o.service ? service < o.service : real < o.real; }
+    };
+    vector<pair<Key, uint32_t>> keys;   // sorted, to applier destination index
+    vector<uint8_t> seen, primed;       // per destination: in this dump / has a previous dump
+    vector<uint64_t> conns, in_bytes, out_bytes;
+    vector<double> conn_rate, in_rate, out_rate;
+    vector<steady_clock::time_point> silent_until;
+    vector<uint8_t> silent;
+    vector<uint8_t> server_silent;      // any destination of the server is flagged
+    vector<double> server_cps;
+    vector<string> labels;              // per destination
+    Textfile metrics;
+    steady_clock::time_point next{}, last{};
+
+    static bool parse_addr(const char* s, uint32_t* addr, uint16_t* port) {
+        char ip[INET_ADDRSTRLEN];
+        const char* colon = strrchr(s, ':');
+        if (!colon || size_t(colon - s) >= sizeof(ip)) return false;
+        memcpy(ip, s, colon - s);
+        ip[colon - s] = 0;
+        in_addr a;
+        if (inet_pton(AF_INET, ip, &a) != 1) return false;
+        *addr = ntohl(a.s_addr);
+        *port = uint16_t(atoi(colon + 1));
+        return true;
+    }
+
+    static uint64_t service_key(uint32_t ns, char type, uint32_t vip, uint16_t port) {
+        return uint64_t(ns & 0xff) << 56 | uint64_t(uint8_t(type)) << 48 | uint64_t(port) << 32 | vip;
+    }
+
+    void init(const Applier& a, const string& metrics_file) {
+        const size_t dests = a.dest_member.size();
+        for (uint32_t d = 0; d < dests; d++) {
+            const uint32_t m = a.dest_member[d];
+            const Service& svc = services[member_service[m]];
+            const string port = to_string(a.dest_port[d]);
+            uint32_t vip, rip;
+            uint16_t p;
+            if (!parse_addr((svc.vip + ":" + port).c_str(), &vip, &p) ||
+                !parse_addr((servers[member_server[m]] + ":" + port).c_str(), &rip, &p))
+                continue;
+            keys.push_back({{service_key(svc.netns, a.dest_type[d], vip, p), uint64_t(p) << 32 | rip}, d});
+        }
+        sort(keys.begin(), keys.end());
+        seen.assign(dests, 0);
+        primed.assign(dests, 0);
+        conns.assign(dests, 0);
+        in_bytes.assign(dests, 0);
+        out_bytes.assign(dests, 0);
+        conn_rate.assign(dests, HUGE_VAL);
+        in_rate.assign(dests, HUGE_VAL);
+        out_rate.assign(dests, HUGE_VAL);
+        silent_until.assign(dests, steady_clock::time_point{});
+        silent.assign(dests, 0);
+        server_silent.assign(servers.size(), 0);
+        server_cps.assign(servers.size(), 0);
+
+        size_t size = 1024;
+        for (uint32_t d = 0; d < dests; d++) {
+            const uint32_t m = a.dest_member[d];
+            labels.push_back("service=\"" + services[member_service[m]].name + "\",backend=\"" +
+                             servers[member_server[m]] + "\",proto=\"" + (a.dest_type[d] == 't' ? "tcp" : "udp") +
+                             "\",port=\"" + to_string(a.dest_port[d]) + "\"");
+            size += 4 * (labels.back().size() + 64);
+        }
+        if (!metrics_file.empty()) metrics.init(metrics_file, size);
+    }
+
+    // Reads one namespace's dump; false if ipvsadm could not be run
+    bool read_dump(uint32_t ns, double elapsed_s, steady_clock::time_point now) {
+        NetnsScope in(ns);
+        if (!in.ok) return false;
+        FILE* pipe = popen("ipvsadm -Ln --stats --exact 2>/dev/null", "r");
+        if (!pipe) return false;
+        char line[256], proto[8], addr[64];
+        unsigned long long c, ip, op, ib, ob;
+        uint64_t service = 0;
+        while (fgets(line, sizeof(line), pipe)) {
+            uint32_t a;
+            uint16_t port;
+            if (line[0] != ' ' && sscanf(line, "%7s %63s %llu", proto, addr, &c) == 3 && parse_addr(addr, &a, &port)) {
+                const char type = strcmp(proto, "TCP") == 0 ? 't' : strcmp(proto, "UDP") == 0 ? 'u' : 0;
+                service = type ? service_key(ns, type, a, port) : 0;
+                continue;
+            }
+            if (!service || sscanf(line, " -> %63s %llu %llu %llu %llu %llu", addr, &c, &ip, &op, &ib, &ob) != 6 ||
+                !parse_addr(addr, &a, &port))
+                continue;
+            const Key key{service, uint64_t(port) << 32 | a};
+            auto it = lower_bound(keys.begin(), keys.end(), make_pair(key, uint32_t(0)));
+            if (it == keys.end() || it->first.service != key.service || it->first.real != key.real) continue;
+            const uint32_t d = it->second;
+            seen[d] = 1;
+            // Counters restart when a destination is re-added
+            if (primed[d] && elapsed_s > 0 && c >= conns[d] && ob >= out_bytes[d] && ib >= in_bytes[d]) {
+                const uint64_t new_conns = c - conns[d];
+                conn_rate[d] = new_conns / elapsed_s;
+                in_rate[d] = (ib - in_bytes[d]) / elapsed_s;
+                out_rate[d] = (ob - out_bytes[d]) / elapsed_s;
+                if (new_conns >= uint64_t(max(PASSIVE_MIN_CONNS, 1)) && ob == out_bytes[d])
+                    silent_until[d] = now + seconds(PASSIVE_HOLD_S);
+            }
+            primed[d] = 1;
+            conns[d] = c;
+            in_bytes[d] = ib;
+            out_bytes[d] = ob;
+        }
+        return pclose(pipe) == 0;
+    }
+
+    // Polls every namespace once per interval; false when it was not yet time
+    bool poll(steady_clock::time_point now, const Applier& a) {
+        if (now < next) return false;
+        next = now + seconds(max(PASSIVE_INTERVAL_S, 1));
+        const double elapsed_s = last == steady_clock::time_point{} ? 0 : duration<double>(now - last).count();
+        last = now;
+
+        for (auto& v : seen) v = 0;
+        for (uint32_t ns = 0; ns < netns.size(); ns++) {
+            bool used = false;
+            for (const Service& svc : services) used |= svc.netns == ns;
+            if (used && !read_dump(ns, elapsed_s, now))
+                cout << "[WARN] ipvsadm -Ln --stats failed" << (ns ? " in network namespace " : "")
+                     << netns.names[ns] << endl;
+        }
+
+        for (auto& v : server_silent) v = 0;
+        for (auto& v : server_cps) v = 0;
+        for (size_t d = 0; d < seen.size(); d++) {
+            if (!seen[d]) {
+                primed[d] = 0;  // not in the table: rates are unknown until two dumps see it again
+                conn_rate[d] = in_rate[d] = out_rate[d] = HUGE_VAL;
+            }
+            const uint32_t m = a.dest_member[d];
+            const bool flagged = now < silent_until[d];
+            if (flagged != bool(silent[d])) {
+                silent[d] = flagged;
+                if (flagged)
+                    cout << "[WARN] " << services[member_service[m]].name << ": " << servers[member_server[m]] << ":"
+                         << a.dest_port[d] << " took " << uint64_t(conn_rate[d] * elapsed_s + 0.5)
+                         << " new connections and sent no bytes back" << endl;
+                else
+                    cout << "[INFO] " << services[member_service[m]].name << ": " << servers[member_server[m]] << ":"
+                         << a.dest_port[d] << " no longer flagged silent" << endl;
+            }
+            server_silent[member_server[m]] |= silent[d];
+            if (!isinf(conn_rate[d])) server_cps[member_server[m]] += conn_rate[d];
+        }
+
+        if (!metrics.path.empty()) {
+            metrics.gauge("lvs_monitor_destination_connections_per_second", "New connections per second from IPVS.",
+                          labels, [&](size_t d) { return conn_rate[d]; });
+            metrics.gauge("lvs_monitor_destination_in_bytes_per_second", "Bytes per second to the backend.", labels,
+                          [&](size_t d) { return in_rate[d]; });
+            metrics.gauge("lvs_monitor_destination_out_bytes_per_second", "Bytes per second from the backend.", labels,
+                          [&](size_t d) { return out_rate[d]; });
+            metrics.gauge("lvs_monitor_destination_silent", "New connections but no bytes back.", labels,
+                          [&](size_t d) { return double(silent[d]); });
+            metrics.commit();
+        }
+        return true;
+    }
+};
+
+// ---------------------------------------------------------
+// JOURNAL QUERY: lvs_monitor journal [-d dir] <backend-ip> [from [to]]
+// from/to: epoch seconds, "YYYY-MM-DD[ HH:MM[:SS]]" (local time), "now" or
+// a relative "-30s", "-15m", "-2h", "-7d". Default: the whole journal.
+bool parse_query_time(const char* s, uint64_t now_ms, uint64_t* out) {
+    if (strcmp(s, "now") == 0) {
+        *out = now_ms;
+        return true;
+    }
+    char* end = nullptr;
+    if (s[0] == '-') {
+        long v = strtol(s + 1, &end, 10);
+        uint64_t unit = *end == 's' ? 1000 : *end == 'm' ? 60000 : *end == 'h' ? 3600000 : *end == 'd' ? 86400000 : 0;
+        if (end == s + 1 || unit == 0 || end[1] != '\0') return false;
+        *out = now_ms - min<uint64_t>(now_ms, uint64_t(v) * unit);
+        return true;
+    }
+    unsigned long long epoch = strtoull(s, &end, 10);
+    if (end != s && *end == '\0') {
+        *out = epoch * 1000;
+        return true;
+    }
+    static const char* formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"};
+    for (const char* f : formats) {
+        tm t{};
+        const char* rest = strptime(s, f, &t);
+        if (!rest || *rest) continue;
+        t.tm_isdst = -1;
+        *out = uint64_t(mktime(&t)) * 1000;
+        return true;
+    }
+    return false;
+}
+
+const uint8_t* map_readonly(const string& path, size_t* size) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return nullptr;
+    *size = st.st_size;
+    return (const uint8_t*)p;
+}
+
+void print_journal_record(const JournalRecord& r) {
+    char when[32], addr[INET_ADDRSTRLEN];
+    time_t secs = time_t(r.time_ms / 1000);
+    tm t;
+    localtime_r(&secs, &t);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+    in_addr a{r.addr};
+    inet_ntop(AF_INET, &a, addr, sizeof(addr));
+
+    printf("%s.%03u %-16s %-15s %s -> %s  %s  loss=%u%% (%u/%u lost) threshold=%u%% latest=%u%%",
+           when, unsigned(r.time_ms % 1000), r.service, addr, state_name(r.from), state_name(r.to),
+           r.reason == REASON_HEALTH     ? "health"
+           : r.reason == REASON_FAILOVER ? "failover"
+           : r.reason == REASON_OUTLIER  ? "outlier"
+                                         : "window",
+           r.samples ? r.loss_sum / r.samples : 0, r.loss_sum / 100, r.samples, r.threshold, r.latest);
+    if (r.rtt_us >= 0) printf(" rtt=%.2fms", r.rtt_us / 1000.0);
+    else printf(" rtt=-");
+    if (r.detail[0]) printf(" failed=%s", r.detail);
+
+    // Newest sample last, like reading the window left to right
+    char bits[65];
+    unsigned shown = min<uint32_t>(r.samples, 64);
+    for (unsigned k = 0; k < shown; k++) bits[k] = (r.window >> (shown - 1 - k)) & 1 ? 'x' : '.';
+    bits[shown] = '\0';
+    printf(" window=%s\n", bits);
+}
+
+int journal_query(int argc, char** argv) {
+    string dir = STATE_DIR;
+    int arg = 2;
+    if (arg + 1 < argc && strcmp(argv[arg], "-d") == 0) {
+        dir = argv[arg + 1];
+        arg += 2;
+    }
+    in_addr backend;
+    if (arg >= argc || inet_pton(AF_INET, argv[arg], &backend) != 1) {
+        fprintf(stderr, "usage: %s journal [-d dir] <backend-ip> [from [to]]\n", argv[0]);
+        return 2;
+    }
+    uint64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    uint64_t from = 0, to = UINT64_MAX;
+    if ((arg + 1 < argc && !parse_query_time(argv[arg + 1], now, &from)) ||
+        (arg + 2 < argc && !parse_query_time(argv[arg + 2], now, &to))) {
+        fprintf(stderr, "bad time; use epoch seconds, YYYY-MM-DD[ HH:MM[:SS]], now or -<n>[smhd]\n");
+        return 2;
+    }
+
+    size_t data_size = 0, index_size = 0;
+    const uint8_t* data = map_readonly(dir + "/journal.dat", &data_size);
+    const uint8_t* index = map_readonly(dir + "/journal.idx", &index_size);
+    if (!data || !index || data_size < sizeof(JournalHeader) || index_size < sizeof(JournalHeader)) {
+        fprintf(stderr, "cannot map journal in %s: %s\n", dir.c_str(), strerror(errno));
+        return 1;
+    }
+    auto* records = (const JournalRecord*)(data + sizeof(JournalHeader));
+    auto* entries = (const JournalIndexEntry*)(index + sizeof(JournalHeader));
+    const uint64_t n_records = (data_size - sizeof(JournalHeader)) / sizeof(JournalRecord);
+    const uint64_t n_entries = min((index_size - sizeof(JournalHeader)) / sizeof(JournalIndexEntry),
+                                   (n_records + JOURNAL_BLOCK - 1) / JOURNAL_BLOCK);
+
+    const uint64_t bit = journal_filter_bit(backend.s_addr);
+    uint64_t lo = 0, hi = n_entries, read_blocks = 0, matches = 0;
+    while (lo < hi) {               // first block that ends at or after `from`
+        uint64_t mid = (lo + hi) / 2;
+        if (entries[mid].last_ms < from) lo = mid + 1;
+        else hi = mid;
+    }
+    auto scan = [&](uint64_t first, uint64_t last) {
+        for (uint64_t k = first; k < last; k++) {
+            const JournalRecord& r = records[k];
+            if (r.addr != backend.s_addr || r.time_ms < from || r.time_ms > to) continue;
+            print_journal_record(r);
+            matches++;
+        }
+    };
+    for (uint64_t e = lo; e < n_entries && entries[e].first_ms <= to; e++) {
+        if (!((entries[e].filter[bit / 64] >> (bit % 64)) & 1)) continue;
+        read_blocks++;
+        scan(e * JOURNAL_BLOCK, min(n_records, (e + 1) * JOURNAL_BLOCK));
+    }
+    scan(n_entries * JOURNAL_BLOCK, n_records);   // records the index has not caught up with
+
+    fprintf(stderr, "%llu transitions, %llu of %llu blocks read\n",
+            (unsigned long long)matches, (unsigned long long)read_blocks, (unsigned long long)n_entries);
+    return 0;
+}
+
+// ---------------------------------------------------------
+// HISTORY QUERY: lvs_monitor history [-d dir] [-s step] <backend-ip>[@path] [from [to]]
+// Dumps one archive of the backend's file as "time loss% rtt_avg rtt_max
+// samples". Without -s, the finest archive that still reaches back to `from`
+// is used. Times as for the journal query; default: the last hour.
+int history_query(int argc, char** argv) {
+    string dir = STATE_DIR + "/rra";
+    uint32_t want_step = 0;
+    int arg = 2;
+    while (arg + 1 < argc && argv[arg][0] == '-' && argv[arg][1] != '\0' && !isdigit((unsigned char)argv[arg][1])) {
+        if (strcmp(argv[arg], "-d") == 0) dir = argv[arg + 1];
+        else if (strcmp(argv[arg], "-s") == 0) want_step = uint32_t(strtoul(argv[arg + 1], nullptr, 10));
+        else break;
+        arg += 2;
+    }
+    in_addr backend;
+    const string target = arg < argc ? argv[arg] : "";
+    const size_t at = target.find('@');
+    const string ip = target.substr(0, at);
+    if (arg >= argc || inet_pton(AF_INET, ip.c_str(), &backend) != 1) {
+        fprintf(stderr, "usage: %s history [-d dir] [-s step-seconds] <backend-ip>[@path] [from [to]]\n", argv[0]);
+        return 2;
+    }
+    uint64_t now = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    uint64_t from = now - 3600 * 1000, to = now;
+    if ((arg + 1 < argc && !parse_query_time(argv[arg + 1], now, &from)) ||
+        (arg + 2 < argc && !parse_query_time(argv[arg + 2], now, &to))) {
+        fprintf(stderr, "bad time; use epoch seconds, YYYY-MM-DD[ HH:MM[:SS]], now or -<n>[smhd]\n");
+        return 2;
+    }
+
+    size_t size = 0;
+    const uint8_t* map =
+        map_readonly(dir + "/" + rra_file_name(ip, at == string::npos ? "" : target.substr(at + 1)), &size);
+    if (!map || size != rra_file_size() || !rra_header_ok((const RraHeader*)map)) {
+        fprintf(stderr, "no usable history for %s in %s\n", argv[arg], dir.c_str());
+        return 1;
+    }
+    const auto* h = (const RraHeader*)map;
+
+    auto oldest_step = [](const RraArchive& c) { return c.cur_step + 1 - min<uint64_t>(c.rows, c.cur_step); };
+    const RraArchive* ar = nullptr;
+    for (uint32_t a = 0; a < RRA_ARCHIVES && !ar; a++) {
+        const RraArchive& c = h->arch[a];
+        if (want_step ? c.step_s == want_step : oldest_step(c) * c.step_s * 1000 <= from) ar = &c;
+    }
+    if (!ar && want_step) {
+        fprintf(stderr, "no archive with a %us step\n", want_step);
+        return 2;
+    }
+    if (!ar) ar = &h->arch[RRA_ARCHIVES - 1];
+    if (ar->cur_step == 0) return 0;
+
+    const auto* rows = (const RraRow*)(map + ar->offset);
+    uint64_t first = max<uint64_t>(from / 1000 / ar->step_s, oldest_step(*ar));
+    uint64_t last = min<uint64_t>(to / 1000 / ar->step_s, ar->cur_step);
+    printf("# %s, %us steps\n# time                loss%%   rtt_avg_ms  rtt_max_ms  samples\n", argv[arg], ar->step_s);
+    for (uint64_t s = first; s <= last; s++) {
+        const RraRow& r = rows[s % ar->rows];
+        if (r.samples == 0) continue;
+        char when[32];
+        time_t secs = time_t(s * ar->step_s);
+        tm t;
+        localtime_r(&secs, &t);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &t);
+        if (r.replies) printf("%s  %6.2f  %10.3f  %10.3f  %7u\n", when, r.loss, r.rtt_avg_ms, r.rtt_max_ms, r.samples);
+        else printf("%s  %6.2f  %10s  %10s  %7u\n", when, r.loss, "-", "-", r.samples);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "journal") == 0) return journal_query(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "history") == 0) return history_query(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "import") == 0) return import_keepalived(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "script-helper") == 0) {   // restarted helper, see ScriptPool
+        script_helper_main(3, 4);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--dry-run") == 0) DRY_RUN = true;
+
+    cout << "[START] LVS Health Monitor (Single Loop Version)\n";
+    cout << "------------------------------------------------\n";
+
+    if (!KEEPALIVED_CONF.empty()) {
+        auto start = steady_clock::now();
+        KeepalivedImport ka;
+        bool ok = ka.load(KEEPALIVED_CONF);
+        for (const auto& w : ka.warnings) cout << "[WARN] " << w << endl;
+        for (const auto& e : ka.errors) cout << "[ERROR] " << e << endl;
+        if (!ok) return 1;
+        SERVICES = move(ka.services);
+        CHECKS = move(ka.checks);
+        cout << "[INFO] Imported " << SERVICES.size() << " services and " << CHECKS.size() << " checks from "
+             << KEEPALIVED_CONF << " in " << duration_cast<milliseconds>(steady_clock::now() - start).count()
+             << "ms" << endl;
+    }
+
+    // Fork script helpers before anything else so they stay small
+    bool want_scripts = false;
+    for (const auto& c : CHECKS) want_scripts |= c.type == "script";
+    if (want_scripts && !script_pool.start(max(SCRIPT_HELPERS, 1))) {
+        cout << "[ERROR] Cannot start script helpers: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    if (!netns.init()) {
+        cout << "[ERROR] Cannot open /proc/self/ns/net: " << strerror(errno) << endl;
+        return 1;
+    }
+    if (!build_services()) return 1;
+    const size_t n = servers.size();
+
+    // A dry run may share STATE_DIR with the live monitor, so it only writes its plan
+    if (DRY_RUN) TRANSITION_JOURNAL = HEALTH_HISTORY = APPLY_METRICS = PROBE_METRICS = false;
+    if (TRANSITION_JOURNAL && !journal.open_dir(STATE_DIR))
+        cout << "[WARN] Cannot open transition journal in " << STATE_DIR << ": " << strerror(errno) << endl;
+    if (HEALTH_HISTORY && !history.init(STATE_DIR + "/rra", servers, server_path))
+        cout << "[WARN] Cannot create " << STATE_DIR << "/rra: " << strerror(errno) << endl;
+
+    // Initialize server states
+    server_state.assign(n, STATE_UNKNOWN);
+    applier.init();
+    if (DRY_RUN && !(mkdir_p(STATE_DIR) && applier.start_plan(STATE_DIR + "/plan.ipvsadm"))) {
+        cout << "[ERROR] Cannot start dry run (ipvsadm -Sn or " << STATE_DIR << "/plan.ipvsadm failed)" << endl;
+        return 1;
+    }
+    if (size_t dests = 0; !DRY_RUN) {
+        if (applier.load_applied(&dests))
+            cout << "[INFO] " << dests << " destinations already in the IPVS table" << endl;
+        else
+            cout << "[WARN] Cannot read the IPVS table (ipvsadm -Sn), first batch adds every destination" << endl;
+    }
+    const string metrics_path = STATE_DIR + "/metrics.prom";
+    if (APPLY_METRICS && !mkdir_p(STATE_DIR))
+        cout << "[WARN] Cannot create " << STATE_DIR << ": " << strerror(errno) << endl;
+
+    vector<int> latest(n), avg(n), window_loss(n);
+    vector<uint8_t> sample_lost(n);
+    vector<uint32_t> loss_sum(n);
+    vector<uint64_t> changed((n + 63) / 64);
+    if (PACKED_LOSS_WINDOWS) packed_windows.init(n, WINDOW_SECONDS);
+    else loss_ring.init(n, WINDOW_SECONDS);
+
+    const char* kernel_name = "";
+    DecideFn decide = select_decide_kernel(&kernel_name);
+    cout << "[INFO] Decision kernel: " << kernel_name << endl;
+    if (SHADOW_POLICY) {
+        // The live monitor's shadow.log is not a dry run's to append to
+        if (!DRY_RUN && !mkdir_p(STATE_DIR))
+            cout << "[WARN] Cannot create " << STATE_DIR << ": " << strerror(errno) << endl;
+        shadow.init(n, DRY_RUN ? "" : STATE_DIR + "/shadow.log");
+    }
+
+    EventLoop loop;
+    IcmpEngine icmp;
+    FpingEngine fping;
+    string engine = PROBE_ENGINE;
+    const bool native_only = probe_paths.size() > 1 || any_of(server_mtu.begin(), server_mtu.end(),
+                                                              [](int m) { return m > 0; });
+    if (engine != "native" && native_only) {
+        cout << "[ERROR] Network namespaces, probe bindings and probe_mtu need the native ICMP engine" << endl;
+        return 1;
+    }
+    if (engine == "native" && !(loop.init() && icmp.init(loop, servers, server_path, server_mtu))) {
+        if (native_only) {
+            cout << "[ERROR] Native ICMP engine unavailable (" << strerror(errno)
+                 << "); fping and ping cannot probe other namespaces, bound paths or with large echoes" << endl;
+            return 1;
+        }
+        cout << "[WARN] Native ICMP engine unavailable (" << strerror(errno) << "), falling back to fping" << endl;
+        engine = "fping";
+    }
+    if (engine == "fping" && !((loop.epfd >= 0 || loop.init()) && fping.init(loop, servers))) {
+        cout << "[WARN] fping coprocess unavailable (" << strerror(errno) << "), falling back to ping" << endl;
+        engine = "ping";
+    }
+    const bool native = engine == "native";
+    const bool streaming = engine == "fping";
+    cout << "[INFO] Probe engine: " << (native ? (icmp.raw ? "native (raw)" : "native (dgram)") : engine) << endl;
+
+    vector<string> ping_commands;
+    for (const auto& s : servers) ping_commands.push_back(ping_command(s));
+    vector<string> server_via(n), path_names(n);
+    for (size_t i = 0; i < n; i++) {
+        path_names[i] = probe_path_name(server_path[i]);
+        if (server_path[i]) server_via[i] = " via " + path_names[i];
+    }
+    JitterEstimator jitter;
+    jitter.init(n);
+    RttBaseline baseline;
+    baseline.init(n);
+    ProbeMetrics probe_metrics;
+    if (PROBE_METRICS) {
+        if (!mkdir_p(STATE_DIR)) cout << "[WARN] Cannot create " << STATE_DIR << ": " << strerror(errno) << endl;
+        probe_metrics.init(STATE_DIR + "/probe.prom", servers, path_names);
+    }
+
+    if (!load_plugins(CHECK_PLUGINS)) return 1;
+
+    CheckRunner checks;
+    if (!CHECKS.empty() && (loop.epfd < 0 && !loop.init())) {
+        cout << "[ERROR] Cannot create event loop for checks" << endl;
+        return 1;
+    }
+    if (!checks.init(loop, servers, server_path, CHECKS)) return 1;
+    if (!script_pool.attach(loop, &checks)) return 1;
+
+    HealthInputs health;
+    health.init(n);
+    if (!PASSIVE_HEALTH && (health.used[SLOT_IPVS_SILENT] || health.used[SLOT_IPVS_CPS])) {
+        cout << "[ERROR] ipvs.* health inputs need PASSIVE_HEALTH = true" << endl;
+        return 1;
+    }
+    PassiveStats passive;
+    passive.init(applier, PASSIVE_HEALTH && PROBE_METRICS ? STATE_DIR + "/passive.prom" : "");
+    OutlierDetector outliers;
+    outliers.init(member_service.size());
+
+    // Services whose failover tiers need a look this tick; all of them on the first
+    vector<uint8_t> tiers_dirty(services.size(), 0);
+    vector<uint32_t> dirty_services;
+    dirty_services.reserve(services.size());
+    for (uint32_t s = 0; s < services.size(); s++)
+        if (services[s].tiered) {
+            tiers_dirty[s] = 1;
+            dirty_services.push_back(s);
+        }
+
+    uint32_t samples = 0;
+#ifdef LVS_ALLOC_ACCOUNTING
+    int tick = 0;
+#endif
+
+    while (true) {
+        auto loop_start = steady_clock::now();
+#ifdef LVS_ALLOC_ACCOUNTING
+        uint64_t allocs_at_start = alloc_count;
+#endif
+
+        auto probe_deadline = loop_start + seconds(PING_TIMEOUT);
+        checks.start_tick(loop_start + milliseconds(CHECK_TIMEOUT_MS));
+        if (native) {
+            icmp.start_tick();
+            loop.run_until(probe_deadline);
+            icmp.finish_tick();
+            for (size_t i = 0; i < n; i++) latest[i] = icmp.loss[i];
+        } else if (streaming) {
+            fping.start_tick();
+            loop.run_until(probe_deadline);
+            fping.finish_tick();
+            for (size_t i = 0; i < n; i++) latest[i] = fping.loss[i];
+        } else {
+            for (size_t i = 0; i < n; i++) latest[i] = ping_server(ping_commands[i].c_str());
+            loop.run_until(probe_deadline);
+        }
+        checks.finish_tick();
+        if (want_scripts) script_pool.restart_dead(loop_start);
+
+        for (size_t i = 0; i < n; i++) {
+            sample_lost[i] = latest[i] > 0 || checks.any_failed(i);
+            window_loss[i] = checks.any_failed(i) ? 100 : latest[i];
+        }
+
+        if (samples < uint32_t(max(WINDOW_SECONDS, 1))) samples++;   // the windows hold at least one sample
+
+        if (PACKED_LOSS_WINDOWS)
+            packed_windows.push_all(sample_lost.data(), loss_sum.data());
+        else
+            loss_ring.push_all(window_loss.data(), loss_sum.data());
+
+        decide(loss_sum.data(), n, samples, LOSS_THRESHOLD, avg.data(), server_state.data(), changed.data());
+        size_t shadow_events = 0;
+        if (SHADOW_POLICY) shadow_events = shadow.update(decide, window_loss.data(), samples, server_state.data(), avg.data());
+
+        const int* rtt_us = native ? icmp.rtt_us.data() : streaming ? fping.rtt_us.data() : nullptr;
+        history.update(duration_cast<seconds>(system_clock::now().time_since_epoch()).count(), latest.data(), rtt_us);
+        jitter.update_all(rtt_us);
+        baseline.update_all(rtt_us);
+        if (PASSIVE_HEALTH) passive.poll(steady_clock::now(), applier);
+        health.update(latest.data(), rtt_us, native ? icmp.mtu_loss.data() : nullptr, loss_sum.data(), samples,
+                      jitter, baseline, passive.server_silent.data(), passive.server_cps.data(), checks);
+        if (PROBE_METRICS) probe_metrics.write(steady_clock::now(), avg.data(), jitter, baseline);
+
+        for (size_t i = 0; i < n; i++) {
+            cout << "[CHECK] " << servers[i] << server_via[i]
+                 << " | Latest=" << latest[i] << "% | Avg(" << WINDOW_SECONDS << "s)=" << avg[i] << "%";
+            for (size_t c = 0; c < CHECKS.size(); c++)
+                if (uint32_t slot = checks.slot_of(c, i); slot != NO_SLOT)
+                    cout << " | " << CHECKS[c].name << "=" << (checks.ok[slot] ? "OK" : "FAIL");
+            cout << "\n";
+        }
+
+        // Only servers whose window verdict flipped or whose health inputs
+        // changed are looked at, and only members that flipped reach ipvsadm
+        [[maybe_unused]] bool transitions = shadow_events > 0;
+        auto transition = [&](uint32_t m, uint8_t want, uint8_t reason) {
+            const size_t i = member_server[m];
+            const Service& svc = services[member_service[m]];
+            JournalRecord r{};
+            inet_pton(AF_INET, servers[i].c_str(), &r.addr);
+            r.from = member_state[m];
+            r.to = want;
+            r.reason = reason;
+            r.latest = uint8_t(latest[i]);
+            r.loss_sum = loss_sum[i];
+            r.samples = samples;
+            r.threshold = LOSS_THRESHOLD;
+            r.rtt_us = rtt_us ? rtt_us[i] : -1;
+            r.window = PACKED_LOSS_WINDOWS ? packed_windows.recent(i) : loss_ring.recent(i);
+            snprintf(r.service, sizeof(r.service), "%s", svc.name.c_str());
+            string failed;
+            for (size_t c = 0; c < CHECKS.size(); c++) {
+                if (checks.passed(c, i)) continue;
+                if (c < 32) r.failed_checks |= 1u << c;
+                failed += (failed.empty() ? "" : ",") + CHECKS[c].name;
+            }
+            snprintf(r.detail, sizeof(r.detail), "%s", failed.c_str());
+            journal.append(r);
+
+            member_state[m] = want;
+            transitions = true;
+            applier.transition(m, avg[i]);
+        };
+
+        for (size_t w = 0; w < changed.size(); w++) {
+            for (uint64_t bits = changed[w] | health.dirty[w]; bits; bits &= bits - 1) {
+                size_t i = w * 64 + __builtin_ctzll(bits);
+                for (uint32_t k = server_members[i]; k < server_members[i + 1]; k++) {
+                    uint32_t m = member_order[k];
+                    const uint32_t s = member_service[m];
+                    const Service& svc = services[s];
+                    uint8_t healthy = server_state[i];
+                    if (!svc.health.code.empty())
+                        healthy = eval_health(svc.health, health.values.data(), n, i) ? STATE_UP : STATE_DOWN;
+                    if (healthy == member_health[m]) continue;
+                    member_health[m] = healthy;
+
+                    if (svc.tiered && !tiers_dirty[s]) {
+                        tiers_dirty[s] = 1;
+                        dirty_services.push_back(s);
+                    }
+                    const uint8_t want = outliers.ejected[m] ? uint8_t(STATE_DOWN) : healthy;
+                    if (member_role[m] == ROLE_PRIMARY && want != member_state[m])
+                        transition(m, want, svc.health.code.empty() ? REASON_WINDOW : REASON_HEALTH);
+                }
+            }
+        }
+
+        // Ejected primaries leave the kernel table and count as down for the tiers
+        if (OUTLIER_DETECTION && outliers.run(steady_clock::now(), avg.data(), jitter)) {
+            for (uint32_t m : outliers.changed) {
+                const uint32_t s = member_service[m];
+                const uint8_t want = outliers.ejected[m] ? uint8_t(STATE_DOWN) : member_health[m];
+                if (want != member_state[m]) transition(m, want, REASON_OUTLIER);
+                if (services[s].tiered && !tiers_dirty[s]) {
+                    tiers_dirty[s] = 1;
+                    dirty_services.push_back(s);
+                }
+            }
+        }
+
+        // Failover tiers of services whose pool changed: backups while fewer
+        // than min_healthy primaries are up, the sorry server while nothing is
+        for (uint32_t s : dirty_services) {
+            Service& svc = services[s];
+            tiers_dirty[s] = 0;
+            int primaries_up = 0, backups_up = 0;
+            for (uint32_t m : svc.members) {
+                if (member_health[m] != STATE_UP || outliers.ejected[m]) continue;
+                primaries_up += member_role[m] == ROLE_PRIMARY;
+                backups_up += member_role[m] == ROLE_BACKUP;
+            }
+            const bool failover = primaries_up < svc.min_healthy;
+            if (failover != svc.failover)
+                cout << (failover ? "[WARN] " : "[INFO] ") << svc.name << ": " << primaries_up << " backends up (min "
+                     << svc.min_healthy << "), " << (failover ? "failing over" : "back on primaries")
+                     << endl;
+            svc.failover = failover;
+            const bool sorry = primaries_up == 0 && (!failover || backups_up == 0);
+            for (uint32_t m : svc.members) {
+                uint8_t want = member_state[m];
+                if (member_role[m] == ROLE_BACKUP)
+                    want = failover && member_health[m] == STATE_UP ? STATE_UP : STATE_DOWN;
+                else if (member_role[m] == ROLE_SORRY)
+                    want = sorry ? STATE_UP : STATE_DOWN;
+                if (want != member_state[m]) transition(m, want, REASON_FAILOVER);
+            }
+        }
+        dirty_services.clear();
+
+        if (applier.run_pending(steady_clock::now()) > 0 || applier.deferring) transitions = true;
+        if (APPLY_METRICS) applier.write_metrics(metrics_path);
+
+#ifdef LVS_ALLOC_ACCOUNTING
+        uint64_t allocs = alloc_count - allocs_at_start;
+        cout << "[ALLOC] tick " << tick << ": " << allocs << " allocations\n";
+        if (++tick > ACCOUNTING_WARMUP_TICKS && !transitions && allocs != 0) {
+            cout << "[FAIL] steady-state tick allocated " << allocs << " times" << endl;
+            return 1;
+        }
+        if (tick >= ACCOUNTING_TICKS) {
+            cout << "[PASS] no steady-state allocations in " << tick << " ticks" << endl;
+            return 0;
         }
+#endif
 
         // Keep 1-second interval
         auto loop_end = steady_clock::now();
@@ -0,0 +1,85 @@
+// ---------------------------------------------------------
+// LVS Health Monitor — check plugin ABI
+//
+// A plugin is a shared object listed in CHECK_PLUGINS. The monitor dlopen()s
+// it at startup and calls its exported lvs_plugin_init(), which registers one
+// or more probe types. A check in CHECKS whose `type` equals a registered
+// name runs that probe type against every server, once per tick, on the
+// monitor's event loop. Plugins must never block: they open non-blocking
+// sockets, ask the host to watch them, and report a result when done.
+//
+// The ABI is plain C and versioned. Structures only ever grow at the end;
+// `struct_size` tells the other side how much of a structure it may read.
+//
+// Build a plugin with:
+//   cc -shared -fPIC -O2 my_check.c -o my_check.so
+#ifndef LVS_PLUGIN_H
+#define LVS_PLUGIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LVS_PLUGIN_ABI_VERSION 1
+
+// Events for watch_fd / on_ready (same bits as EPOLLIN / EPOLLOUT)
+#define LVS_EV_READ  0x001u
+#define LVS_EV_WRITE 0x004u
+#define LVS_EV_ERROR 0x008u
+
+// Opaque handle for one running probe; owned by the monitor
+typedef struct lvs_probe lvs_probe;
+
+typedef struct lvs_probe_type {
+    uint32_t abi_version;       // LVS_PLUGIN_ABI_VERSION
+    uint32_t struct_size;       // sizeof(lvs_probe_type)
+    const char* name;           // check type used in CHECKS, e.g. "acme55665"
+    size_t state_size;          // per-probe state preallocated (zeroed) by the monitor
+
+    // Start a probe against addr (port already set from the check). `arg` is
+    // the check's `path` field. Return 0 if the probe is running or has
+    // already called complete(); non-zero means the check failed to start.
+    int (*start)(lvs_probe* probe, void* state, const struct sockaddr_in* addr, const char* arg);
+
+    // The watched fd became ready. Either watch again or call complete().
+    // Like start(), it runs inside the network namespace of the server, so a
+    // socket opened here reaches the same backend.
+    void (*on_ready)(lvs_probe* probe, void* state, int fd, uint32_t events);
+
+    // Deadline passed or the tick ended before complete(). Release anything
+    // the probe holds other than the watched fd, which the monitor closes.
+    void (*cancel)(lvs_probe* probe, void* state);
+} lvs_probe_type;
+
+typedef struct lvs_host_api {
+    uint32_t abi_version;       // LVS_PLUGIN_ABI_VERSION of the monitor
+    uint32_t struct_size;       // sizeof(lvs_host_api)
+
+    // Register a probe type; the structure must stay valid while loaded. 0 on success.
+    int (*register_probe_type)(const lvs_probe_type* type);
+
+    // One-shot readiness watch (LVS_EV_READ / LVS_EV_WRITE). The monitor takes
+    // ownership of fd and closes it when the probe ends; watching a different
+    // fd closes the previous one. 0 on success.
+    int (*watch_fd)(lvs_probe* probe, int fd, uint32_t events);
+
+    // Final result. `status` is a protocol code shown in logs (0 if none).
+    void (*complete)(lvs_probe* probe, int ok, int status);
+
+    // Log a line through the monitor, prefixed with [PLUGIN]
+    void (*log)(const char* message);
+} lvs_host_api;
+
+// Exported by every plugin. Return 0 on success.
+typedef int (*lvs_plugin_init_fn)(const lvs_host_api* host);
+#define LVS_PLUGIN_INIT_SYMBOL "lvs_plugin_init"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LVS_PLUGIN_H